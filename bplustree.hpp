@@ -1,11 +1,26 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
 #include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "cacheline.hpp"
 
 template <typename T> class SegmentedFreelistAllocator {
 public:
@@ -25,83 +40,148 @@ private:
     node_type *data;
     std::size_t size;
     Segment *next;
+    std::pmr::memory_resource *resource;
+
+    Segment(std::size_t segmentSize, std::pmr::memory_resource *resource)
+        : size(segmentSize), next(nullptr), resource(resource) {
+      data = static_cast<node_type *>(resource->allocate(
+          segmentSize * sizeof(node_type), alignof(node_type)));
+    }
+
+    ~Segment() {
+      resource->deallocate(data, size * sizeof(node_type), alignof(node_type));
+    }
+  };
 
-    Segment(std::size_t segmentSize) : size(segmentSize), next(nullptr) {
-      data = static_cast<node_type *>(
-          ::operator new(segmentSize * sizeof(node_type)));
+  static void freeSegments(Segment *head) {
+    while (head) {
+      Segment *next = head->next;
+      delete head;
+      head = next;
     }
+  }
 
-    ~Segment() { ::operator delete(data); }
+  // state of an allocator and all its copies
+  struct Pool {
+    std::pmr::memory_resource *resource;
+    std::size_t initialCapacity;
+    std::size_t capacity;
+    std::size_t allocated = 0;
+    Segment *segments = nullptr; // reserved by the first allocation
+    Segment *current = nullptr;  // segment that untouched slots are taken from
+    std::size_t bumpIndex = 0;
+    FreeNode *freeList = nullptr;
+    std::size_t epoch = 0; // bumped by release()
+
+    Pool(std::size_t initialCapacity, std::pmr::memory_resource *resource)
+        : resource(resource), initialCapacity(initialCapacity),
+          capacity(initialCapacity) {}
+
+    ~Pool() { freeSegments(segments); }
+
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
   };
 
-  std::size_t capacity;
-  std::size_t allocated;
-  Segment *segments;
-  FreeNode *freeList;
+  std::shared_ptr<Pool> pool;
 
   void expand() {
-    std::size_t newSegmentSize = capacity * 1.5;
-    auto *newSegment = new Segment(newSegmentSize);
+    pool->bumpIndex = 0;
+
+    if (!pool->current) {
+      if (!pool->segments) {
+        pool->segments = new Segment(pool->capacity, pool->resource);
+      }
 
-    newSegment->next = segments;
-    segments = newSegment;
+      pool->current = pool->segments;
+      return;
+    }
 
-    for (std::size_t i = 0; i < newSegmentSize; i++) {
-      FreeNode *node = &newSegment->data[i].node;
-      node->next = freeList;
-      freeList = node;
+    // reuse segments left over from before a reset
+    if (pool->current->next) {
+      pool->current = pool->current->next;
+      return;
     }
 
-    capacity = newSegmentSize;
+    std::size_t newSegmentSize = pool->capacity * 1.5;
+    pool->current->next = new Segment(newSegmentSize, pool->resource);
+    pool->current = pool->current->next;
+    pool->capacity = newSegmentSize;
   }
 
 public:
-  explicit SegmentedFreelistAllocator(std::size_t initialCapacity = 256)
-      : capacity(initialCapacity), allocated(0), segments(nullptr),
-        freeList(nullptr) {
+  // Copies share the pool and compare equal, so one pool can serve many
+  // trees. Segments are taken from resource, the first one on the first
+  // allocation.
+  explicit SegmentedFreelistAllocator(
+      std::size_t initialCapacity = 256,
+      std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+      : pool(std::make_shared<Pool>(initialCapacity, resource)) {
     assert(initialCapacity > 0);
-    segments = new Segment(initialCapacity);
-    reset();
   }
 
-  ~SegmentedFreelistAllocator() {
-    while (segments) {
-      Segment *next = segments->next;
-      delete segments;
-      segments = next;
-    }
+  // moves copy, so a moved-from allocator still has a pool to draw from
+  SegmentedFreelistAllocator(const SegmentedFreelistAllocator &) = default;
+  SegmentedFreelistAllocator &
+  operator=(const SegmentedFreelistAllocator &) = default;
+
+  // whether no other copy draws from the pool
+  bool exclusive() const noexcept { return pool.use_count() == 1; }
+
+  std::pmr::memory_resource *resource() const noexcept {
+    return pool->resource;
   }
 
+  // releases all allocations at once but keeps the segments for reuse
   void reset() {
-    freeList = nullptr;
-    for (std::size_t i = 0; i < segments->size; i++) {
-      FreeNode *node = &segments->data[i].node;
-      node->next = freeList;
-      freeList = node;
-    }
+    pool->freeList = nullptr;
+    pool->current = pool->segments;
+    pool->bumpIndex = 0;
+    pool->allocated = 0;
+  }
+
+  // Returns all segments to the resource and starts over, which frees every
+  // object of every copy at once. Objects are not destroyed.
+  void release() {
+    freeSegments(pool->segments);
+    pool->capacity = pool->initialCapacity;
+    pool->segments = pool->current = nullptr;
+    pool->bumpIndex = 0;
+    pool->freeList = nullptr;
+    pool->allocated = 0;
+    pool->epoch++;
   }
 
+  // counts calls to release(), so holders of objects can tell theirs are gone
+  std::size_t epoch() const noexcept { return pool->epoch; }
+
   [[nodiscard]] value_type *allocate(std::size_t n) {
     if (n != 1)
       throw std::bad_alloc();
 
-    if (!freeList) {
-      expand();
+    Pool &state = *pool;
+    state.allocated++;
+
+    if (state.freeList) {
+      FreeNode *node = state.freeList;
+      state.freeList = state.freeList->next;
+      return reinterpret_cast<value_type *>(node);
     }
 
-    FreeNode *node = freeList;
-    freeList = freeList->next;
-    allocated++;
+    if (!state.current || state.bumpIndex == state.current->size) {
+      expand();
+    }
 
-    return reinterpret_cast<value_type *>(node);
+    return reinterpret_cast<value_type *>(
+        &state.current->data[state.bumpIndex++]);
   }
 
   void deallocate(value_type *ptr) {
     auto *node = reinterpret_cast<FreeNode *>(ptr);
-    node->next = freeList;
-    freeList = node;
+    node->next = pool->freeList;
+    pool->freeList = node;
 
-    allocated--;
+    pool->allocated--;
   }
 
   // for std::allocator compliance
@@ -113,58 +193,422 @@ public:
   }
 
   bool operator==(const SegmentedFreelistAllocator &other) const noexcept {
-    return this == &other;
+    return pool == other.pool;
+  }
+
+  struct Statistics {
+    std::size_t segments = 0;
+    std::size_t bytes = 0;     // reserved by all segments
+    std::size_t allocated = 0; // slots currently handed out
+    std::size_t freeList = 0;  // released slots waiting for reuse
+  };
+
+  // walks the segment list, so this is linear in the number of segments
+  Statistics statistics() const noexcept {
+    Statistics stats;
+    std::size_t bumped = 0;
+    bool beforeCurrent = true;
+
+    for (const Segment *segment = pool->segments; segment;
+         segment = segment->next) {
+      stats.segments++;
+      stats.bytes += segment->size * sizeof(node_type);
+
+      if (segment == pool->current) {
+        bumped += pool->bumpIndex;
+        beforeCurrent = false;
+      } else if (beforeCurrent) {
+        bumped += segment->size;
+      }
+    }
+
+    // every slot taken from a segment is either in use or on the free list
+    stats.allocated = pool->allocated;
+    stats.freeList = bumped - pool->allocated;
+    return stats;
   }
 };
 
+/**
+ * Aggregation policies summarize the values of a subtree as a monoid:
+ * identity() is the neutral element, lift() summarizes a single value and
+ * combine() joins two summaries in key order.
+ */
+struct NoAggregate {
+  struct summary_type {};
+};
+
+template <typename T> struct SumAggregate {
+  using summary_type = T;
+
+  static T identity() { return T{}; }
+  static T lift(const T &value) { return value; }
+  static T combine(const T &a, const T &b) { return a + b; }
+};
+
+template <typename T> struct MinAggregate {
+  using summary_type = T;
+
+  static T identity() { return std::numeric_limits<T>::max(); }
+  static T lift(const T &value) { return value; }
+  static T combine(const T &a, const T &b) { return b < a ? b : a; }
+};
+
+template <typename T> struct MaxAggregate {
+  using summary_type = T;
+
+  static T identity() { return std::numeric_limits<T>::lowest(); }
+  static T lift(const T &value) { return value; }
+  static T combine(const T &a, const T &b) { return a < b ? b : a; }
+};
+
+/**
+ * Statistics policies select which counters a tree keeps on its hot paths.
+ * NoStats keeps none and compiles every counter update away. A custom policy
+ * needs the members of CountingStats and may add its own.
+ */
+struct NoStats {};
+
+struct CountingStats {
+  std::size_t splits = 0;
+  std::size_t merges = 0;
+  std::size_t lookups = 0;     // root to leaf searches for a single key
+  std::size_t comparisons = 0; // key comparisons made while searching nodes
+};
+
+/**
+ * Hints that the given bytes will be read soon, one cache line at a time.
+ * Compiles to nothing where the compiler offers no prefetch builtin.
+ */
+inline void prefetchBytes([[maybe_unused]] const void *address,
+                          [[maybe_unused]] std::size_t bytes) {
+#if defined(__GNUC__) || defined(__clang__)
+  const char *first = static_cast<const char *>(address);
+
+  for (std::size_t offset = 0; offset < bytes; offset += CACHE_LINE_SIZE) {
+    __builtin_prefetch(first + offset);
+  }
+#endif
+}
+
+/**
+ * Prefetches the leaf distance steps past leaf. A scan reaches the leaves in
+ * between first, and those were prefetched on earlier steps, so following
+ * their links rarely misses.
+ */
+template <typename Leaf>
+void prefetchAhead(const Leaf *leaf, bool forward, unsigned distance) {
+  for (unsigned i = 0; leaf && i < distance; i++) {
+    leaf = forward ? leaf->next : leaf->prev;
+  }
+
+  if (leaf && distance > 0) {
+    prefetchBytes(leaf, sizeof(Leaf));
+  }
+}
+
+/**
+ * Value type that turns BPlusTree into an ordered set. Leaves then hold keys
+ * only, no values are allocated and iterators yield the keys.
+ */
+struct NoValue {};
+
+/**
+ * With OrderStatistics enabled, inner nodes keep the number of keys below each
+ * child, which makes rank, select and count_range run in O(log n).
+ *
+ * An Aggregate policy other than NoAggregate makes inner nodes keep a summary
+ * of the values below each child, so aggregate(lo, hi) runs in O(log n).
+ * Summaries are only updated by the tree's own operations, so values must not
+ * be modified in place through at() or iterators.
+ *
+ * A Stats policy other than NoStats counts splits, merges, lookups and key
+ * comparisons, and enables statistics() for inspecting the tree's shape and
+ * memory use.
+ *
+ * With Value set to NoValue the tree is an ordered set, see BPlusTreeSet.
+ * Inner nodes and leaves have separate layouts and pools, so only leaves carry
+ * value pointers and sibling links.
+ *
+ * Pools take their segments from a std::pmr::memory_resource. Many trees can
+ * share their pools through an Arena, which also frees all of them at once.
+ */
 template <typename Key, typename Value, std::size_t N,
-          typename ValueAllocator = SegmentedFreelistAllocator<Value>>
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>,
+          bool OrderStatistics = false, typename Aggregate = NoAggregate,
+          typename Stats = NoStats>
 class BPlusTree {
 
 public:
   using key_type = Key;
   using value_type = Value;
+  using summary_type = typename Aggregate::summary_type;
 
   static_assert(N > 3, "N must be greater than 3");
 
 private:
+  struct Empty {};
+
+  // a second empty type, so both unused per child arrays take no space
+  struct NoSummaries {};
+
+  // slots in the first segment of the node pools
+  static constexpr std::size_t INNER_SEGMENT = 16;
+  static constexpr std::size_t LEAF_SEGMENT = 64;
+
+  // Arithmetic keys are counted without branches, which beats bisection until
+  // the keys span about 32 cache lines. Other keys are compared with branches,
+  // so scanning them only pays off while they fit in two.
+  static constexpr std::size_t LINEAR_SEARCH_KEYS =
+      (std::is_arithmetic_v<Key> ? 32 : 2) * CACHE_LINE_SIZE / sizeof(Key);
+
+  // keys in a cache line, the first step of an interpolation search
+  static constexpr std::size_t INTERPOLATION_WINDOW =
+      std::max<std::size_t>(CACHE_LINE_SIZE / sizeof(Key), 1);
+
+  static constexpr bool aggregated = !std::is_same_v<Aggregate, NoAggregate>;
+
+  using ChildCounts =
+      std::conditional_t<OrderStatistics, std::size_t[N + 2], Empty>;
+
+  using ChildSummaries =
+      std::conditional_t<aggregated, summary_type[N + 2], NoSummaries>;
+
+  // fast paths that skip the descent can't keep per child data up to date
+  static constexpr bool augmented = OrderStatistics || aggregated;
+
+  static constexpr bool instrumented = !std::is_same_v<Stats, NoStats>;
+
+  static constexpr bool keysOnly = std::is_same_v<Value, NoValue>;
+
+  static_assert(!(keysOnly && aggregated), "sets have no values to aggregate");
+
+  using ValueSlots = std::conditional_t<keysOnly, Empty, value_type *[N + 1]>;
+
+  // part shared by inner nodes and leaves, the depth tells which one it is
   struct Node {
     std::size_t size = 0;
-    union {
-      Node *children[N + 2];
-      value_type *values[N + 1];
-    };
-
-    Node *next = nullptr;
-    Node *prev = nullptr;
     key_type keys[N + 1];
 
   public:
     Node() {}
+  };
+
+  struct InnerNode : Node {
+    Node *children[N + 2];
+
+    // keys below each child
+    [[no_unique_address]] ChildCounts counts;
+
+    // summary of the values below each child
+    [[no_unique_address]] ChildSummaries summaries;
+
+  public:
+    InnerNode() {}
+
+    InnerNode(Node *child) { children[0] = child; }
+  };
+
+  struct LeafNode : Node {
+    LeafNode *next = nullptr;
+    LeafNode *prev = nullptr;
+
+    // sets keep no values at all
+    [[no_unique_address]] ValueSlots values;
+
+  public:
+    LeafNode() {}
+  };
+
+  static InnerNode *asInner(Node *node) {
+    return static_cast<InnerNode *>(node);
+  }
+
+  static const InnerNode *asInner(const Node *node) {
+    return static_cast<const InnerNode *>(node);
+  }
+
+  static LeafNode *asLeaf(Node *node) { return static_cast<LeafNode *>(node); }
+
+  static const LeafNode *asLeaf(const Node *node) {
+    return static_cast<const LeafNode *>(node);
+  }
+
+  // requests all cache lines of the keys of a node about to be searched, so
+  // their misses overlap instead of being taken one line at a time, or only
+  // the first line where interpolation touches just a few of them
+  void prefetchKeys(const Node *node) const {
+    prefetchBytes(node, interpolate ? CACHE_LINE_SIZE : sizeof(Node));
+  }
+
+  // keys that map to unsigned integers of the same order
+  static constexpr bool radixKeys =
+      std::is_integral_v<Key> && !std::is_same_v<Key, bool>;
+
+  /**
+   * Maps integral keys straight to their leaf, see set_directory(). It lists
+   * the leaves in order together with the first key of each leaf but the
+   * first. A radix table indexed by the high bits of a key gives the run of
+   * those first keys sharing them, so a lookup bisects a few adjacent keys
+   * instead of descending through the inner nodes. This relies on inner keys
+   * being copies of the first key of the leaf to their right, which holds
+   * until the inner nodes change.
+   */
+  struct LeafDirectory {
+    using Bits =
+        std::make_unsigned_t<std::conditional_t<radixKeys, Key, unsigned>>;
+
+    std::vector<key_type> firstKeys; // of leaves[1], leaves[2], ...
+    std::vector<LeafNode *> leaves;
+    std::vector<std::uint32_t> radix; // first keys in the buckets below
+    Bits base = 0;                    // bits of the smallest first key
+    unsigned shift = 0;               // low bits ignored by the buckets
+    std::size_t version = 0;          // of the tree when last in sync
+    std::size_t staleLookups = 0;     // since it fell out of sync
+
+    static Bits bits(const key_type &key)
+      requires radixKeys
+    {
+      if constexpr (std::is_signed_v<key_type>) {
+        return static_cast<Bits>(key) ^ (Bits(1) << (sizeof(Bits) * 8 - 1));
+      } else {
+        return key;
+      }
+    }
+
+    // keys below base land in the first bucket, those past the span of the
+    // first keys when the table was laid out in the last one
+    std::size_t bucket(const key_type &key) const
+      requires radixKeys
+    {
+      Bits keyBits = bits(key);
+
+      if (keyBits < base)
+        return 0;
+
+      return std::min<std::size_t>((keyBits - base) >> shift,
+                                   radix.size() - 2);
+    }
+
+    // position of the leaf that holds key if the tree has it
+    std::size_t find(const key_type &key) const
+      requires radixKeys
+    {
+      std::size_t b = bucket(key);
+      return std::upper_bound(firstKeys.begin() + radix[b],
+                              firstKeys.begin() + radix[b + 1], key) -
+             firstKeys.begin();
+    }
+
+    // lays out about one bucket per first key over their span
+    void index()
+      requires radixKeys
+    {
+      std::size_t buckets =
+          std::bit_ceil(std::max<std::size_t>(firstKeys.size(), 1));
+      base = firstKeys.empty() ? 0 : bits(firstKeys.front());
+      Bits span = firstKeys.empty() ? 0 : bits(firstKeys.back()) - base;
+      shift = 0;
+
+      while (Bits(span >> shift) >= buckets) {
+        shift++;
+      }
+
+      radix.assign(buckets + 1, 0);
+
+      for (const key_type &key : firstKeys) {
+        radix[bucket(key) + 1]++;
+      }
+
+      for (std::size_t b = 1; b <= buckets; b++) {
+        radix[b] += radix[b - 1];
+      }
+    }
+
+    // lists the leaves from leaf on as of the given tree version
+    void build(LeafNode *leaf, std::size_t treeVersion)
+      requires radixKeys
+    {
+      version = treeVersion;
+      staleLookups = 0;
+      firstKeys.clear();
+      leaves.clear();
+
+      for (; leaf; leaf = leaf->next) {
+        if (!leaves.empty()) {
+          firstKeys.push_back(leaf->keys[0]);
+        }
+
+        leaves.push_back(leaf);
+      }
+
+      index();
+    }
+
+    // Records that right was split off left unless that means shifting more
+    // than MAX_SHIFT entries, returns whether it did. Appends always make it,
+    // splits far from the end leave the directory to go stale.
+    bool split(LeafNode *left, LeafNode *right)
+      requires radixKeys
+    {
+      static constexpr std::size_t MAX_SHIFT = 1024;
+
+      std::size_t i = find(left->keys[0]);
+      std::size_t b = bucket(right->keys[0]);
+      assert(leaves[i] == left);
+
+      if (firstKeys.size() - i > MAX_SHIFT || radix.size() - b > MAX_SHIFT)
+        return false;
+
+      firstKeys.insert(firstKeys.begin() + i, right->keys[0]);
+      leaves.insert(leaves.begin() + i + 1, right);
 
-    Node(Node *child) { children[0] = child; }
+      if (firstKeys.size() > 2 * (radix.size() - 1)) {
+        index();
+        return true;
+      }
+
+      for (b++; b < radix.size(); b++) {
+        radix[b]++;
+      }
+
+      return true;
+    }
   };
 
 public:
   class BPlusTreeIterator {
 
   private:
-    Node *current;
+    LeafNode *current;
     std::size_t idx;
     bool forward;
+    unsigned distance; // leaves prefetched ahead, see set_prefetch_distance
 
     template <typename Iterator>
     friend Iterator &incrementIterator(Iterator &it, bool forward);
 
   public:
-    using value_type = Value;
+    // keys can't be modified through iterators of a set
+    using value_type = std::conditional_t<keysOnly, const Key, Value>;
+
+    BPlusTreeIterator()
+        : current(nullptr), idx(0), forward(false), distance(0) {}
+    explicit BPlusTreeIterator(LeafNode *node, std::size_t idx, bool forward,
+                               unsigned distance = 0)
+        : current(node), idx(idx), forward(forward), distance(distance) {}
+
+    value_type &operator*() const {
+      if constexpr (keysOnly) {
+        return current->keys[idx];
+      } else {
+        return *current->values[idx];
+      }
+    }
 
-    BPlusTreeIterator() : current(nullptr), idx(0), forward(false) {}
-    explicit BPlusTreeIterator(Node *node, std::size_t idx, bool forward)
-        : current(node), idx(idx), forward(forward) {}
+    value_type *operator->() { return &**this; }
 
-    value_type &operator*() const { return *current->values[idx]; }
-    value_type *operator->() { return current->values[idx]; }
+    const key_type &key() const { return current->keys[idx]; }
 
     BPlusTreeIterator &operator++() {
       return incrementIterator<BPlusTreeIterator>(*this, forward);
@@ -187,35 +631,46 @@ public:
     }
 
     bool operator==(const BPlusTreeIterator &other) const {
-      return current == other.current;
+      return current == other.current && idx == other.idx;
     }
     bool operator!=(const BPlusTreeIterator &other) const {
-      return current != other.current;
+      return !(*this == other);
     }
   };
 
   class ConstBPlusTreeIterator {
   private:
-    const Node *current;
+    const LeafNode *current;
     std::size_t idx;
     bool forward;
+    unsigned distance;
 
     template <typename Iterator>
     friend Iterator &incrementIterator(Iterator &it, bool forward);
 
   public:
-    using value_type = Value;
+    using value_type = std::conditional_t<keysOnly, const Key, Value>;
+
+    ConstBPlusTreeIterator()
+        : current(nullptr), idx(0), forward(false), distance(0) {}
+    explicit ConstBPlusTreeIterator(const LeafNode *node, std::size_t idx,
+                                    bool forward, unsigned distance = 0)
+        : current(node), idx(idx), forward(forward), distance(distance) {}
+
+    const value_type &operator*() const {
+      if constexpr (keysOnly) {
+        return current->keys[idx];
+      } else {
+        return *current->values[idx];
+      }
+    }
 
-    ConstBPlusTreeIterator() : current(nullptr), idx(0), forward(false) {}
-    explicit ConstBPlusTreeIterator(const Node *node, std::size_t idx,
-                                    bool forward)
-        : current(node), idx(idx), forward(forward) {}
+    const value_type *operator->() const { return &**this; }
 
-    const value_type &operator*() const { return *current->values[idx]; }
-    const value_type *operator->() const { return current->values[idx]; }
+    const key_type &key() const { return current->keys[idx]; }
 
     ConstBPlusTreeIterator &operator++() {
-      return incrementIterator<BPlusTreeIterator>(*this, forward);
+      return incrementIterator<ConstBPlusTreeIterator>(*this, forward);
     }
 
     ConstBPlusTreeIterator operator++(int) {
@@ -225,7 +680,7 @@ public:
     }
 
     ConstBPlusTreeIterator &operator--() {
-      return incrementIterator<BPlusTreeIterator>(*this, !forward);
+      return incrementIterator<ConstBPlusTreeIterator>(*this, !forward);
     }
 
     ConstBPlusTreeIterator operator--(int) {
@@ -235,10 +690,10 @@ public:
     }
 
     bool operator==(const ConstBPlusTreeIterator &other) const {
-      return current == other.current;
+      return current == other.current && idx == other.idx;
     }
     bool operator!=(const ConstBPlusTreeIterator &other) const {
-      return current != other.current;
+      return !(*this == other);
     }
   };
 
@@ -252,162 +707,791 @@ public:
   using reverse_const_iterator =
       ConstBPlusTreeIterator; // std::reverse_iterator<ConstBPlusTreeIterator>;
 
-private:
-  ValueAllocator valueAllocator;
-  SegmentedFreelistAllocator<Node> nodeAllocator;
-  Node *root = nullptr;
-  Node *minNode = nullptr;
-  Node *maxNode = nullptr;
-  unsigned height = 0;
-  std::size_t keyCount = 0;
+  /**
+   * Entry taken out of a tree by extract(), owning its key and value. The
+   * value stays in the slot it was allocated in, so inserting the handle into
+   * the same tree or one with an equal allocator moves nothing. A handle has
+   * to be inserted or destroyed before the tree it came from is destroyed or
+   * moved.
+   */
+  class node_type {
+  private:
+    friend class BPlusTree;
 
-  bool findKeyInNode(Node *, const key_type &, std::size_t &) const;
+    BPlusTree *source = nullptr;
+    std::optional<key_type> entry;
+    [[no_unique_address]] std::conditional_t<keysOnly, Empty, value_type *>
+        value{};
 
-  template<typename KeyFwd>
-  void insertLeaf(Node *, std::size_t, KeyFwd &&, value_type *);
+    node_type(BPlusTree *source, const key_type &key) noexcept
+        : source(source), entry(key) {}
 
-  void removeKeyFromLeaf(Node *, std::size_t);
+    void release() noexcept {
+      if constexpr (!keysOnly) {
+        if (source) {
+          source->releaseDetached(value);
+        }
+      }
 
-  template<typename KeyFwd>
-  void insertInner(Node *, std::size_t, KeyFwd &&, Node *);
+      source = nullptr;
+      entry.reset();
+    }
 
-  void removeInnerKey(Node *, std::size_t);
+  public:
+    node_type() = default;
 
-  void split(Node *, std::size_t, bool);
+    node_type(node_type &&other) noexcept
+        : source(std::exchange(other.source, nullptr)),
+          entry(std::move(other.entry)), value(other.value) {
+      other.entry.reset();
+    }
 
-  template <typename... Args>
-  void insert(unsigned, Node *, const key_type &, Args &&...);
+    node_type &operator=(node_type &&other) noexcept {
+      if (this != &other) {
+        release();
+        source = std::exchange(other.source, nullptr);
+        entry = std::move(other.entry);
+        value = other.value;
+        other.entry.reset();
+      }
 
-  template <typename Iterator>
-  Iterator find(Node *, const key_type &, unsigned) const;
+      return *this;
+    }
 
-  void freeValues(Node *);
+    ~node_type() { release(); }
 
-public:
-  BPlusTree() : nodeAllocator(64), root(nullptr){};
+    bool empty() const noexcept { return !source; }
 
-  BPlusTree(BPlusTree &&other)
-      : nodeAllocator(std::move(other.nodeAllocator)), root(other.root),
-        minNode(other.minNode), maxNode(other.maxNode), height(other.height),
-        keyCount(other.keyCount) {
+    explicit operator bool() const noexcept { return source; }
 
-    other.root = nullptr;
-    other.minNode = nullptr;
-    other.maxNode = nullptr;
-    other.keyCount = 0;
-    other.height = 0;
+    key_type &key() const { return const_cast<key_type &>(*entry); }
+
+    value_type &mapped() const
+      requires(!keysOnly)
+    {
+      return *value;
+    }
   };
 
-  BPlusTree &operator=(BPlusTree &&other) {
-    nodeAllocator = std::move(other.nodeAllocator);
-    root = other.root;
-    minNode = other.minNode;
-    maxNode = other.maxNode;
-    height = other.height;
-    keyCount = other.keyCount;
+  /**
+   * Pools for nodes and values that any number of trees of this type can
+   * share, such as all small trees of one tenant. Trees on an arena reserve no
+   * segments of their own and release() frees the memory of all of them at
+   * once. Segments come from the given memory resource.
+   */
+  class Arena {
+  private:
+    friend class BPlusTree;
 
-    other.root = nullptr;
-    other.minNode = nullptr;
-    other.maxNode = nullptr;
-    other.keyCount = 0;
-    other.height = 0;
+    SegmentedFreelistAllocator<InnerNode> inner;
+    SegmentedFreelistAllocator<LeafNode> leaves;
+    [[no_unique_address]] std::conditional_t<keysOnly, Empty, ValueAllocator>
+        values;
+
+  public:
+    explicit Arena(
+        std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : inner(INNER_SEGMENT, resource), leaves(LEAF_SEGMENT, resource),
+          values(makeValueAllocator(resource)) {}
+
+    // Frees the nodes and values of all trees on the arena at once, without
+    // running any destructors. Those trees may only be cleared or destroyed
+    // afterwards. Only offered where skipping the destructors leaks nothing:
+    // keys and values must be trivially destructible, unlike strings, and
+    // the value allocator must be able to release its segments as well.
+    void release()
+      requires std::is_trivially_destructible_v<Key> &&
+               std::is_trivially_destructible_v<Value> &&
+               (keysOnly || requires(ValueAllocator &allocator) {
+                 allocator.release();
+               })
+    {
+      inner.release();
+      leaves.release();
+
+      if constexpr (!keysOnly) {
+        values.release();
+      }
+    }
   };
 
-  BPlusTree(const BPlusTree &) = delete;
-  BPlusTree &operator=(const BPlusTree &) = delete;
+  /**
+   * Remembers the root-to-leaf path of the last seek, so that lookups of
+   * nearby keys only climb as far as needed before descending again. A cursor
+   * stays usable across inserts and erases but restarts at the root whenever
+   * inner nodes have changed since its last seek.
+   */
+  class Cursor {
+  private:
+    friend class BPlusTree;
+
+    // the subtree of node holds keys in [lo, hi), nullptr means unbounded
+    struct Frame {
+      Node *node;
+      std::size_t idx; // position of node within its parent
+      key_type *lo;
+      key_type *hi;
+    };
 
-  ~BPlusTree() {
-    freeValues(minNode);
-    root = nullptr;
-    minNode = nullptr;
-    maxNode = nullptr;
-  }
+    BPlusTree *tree;
+    std::vector<Frame> path;
+    std::size_t version = 0;
 
-  std::size_t size() const { return keyCount; }
+    static bool covers(const Frame &frame, const key_type &key) {
+      return (!frame.lo || !(key < *frame.lo)) &&
+             (!frame.hi || key < *frame.hi);
+    }
 
-  bool empty() const { return keyCount > 0; }
+    bool stepSibling(const key_type &);
 
-  template <typename... Args> 
-  void emplace(const key_type &, Args &&...);
+    void descend(std::size_t, const key_type &);
 
-  template <typename ValueFwd> 
-  void insert(const key_type &, ValueFwd &&);
+    LeafNode *seekLeaf(const key_type &);
 
-  void insert(const std::pair<key_type, value_type> &entry) {
-    insert(entry.first, entry.second);
-  }
+  public:
+    explicit Cursor(BPlusTree &tree) : tree(&tree) {}
 
-  bool erase(const key_type &);
+    iterator seek(const key_type &);
+  };
 
-  bool erase(unsigned, Node *, const key_type &);
+  /**
+   * Snapshot of the counters together with the shape and memory use of the
+   * tree at the time statistics() was called.
+   */
+  struct Statistics {
+    Stats counters;
+    std::vector<std::size_t> nodesPerLevel; // starting at the root
+    double leafFill = 0;                    // share of leaf slots in use
+    double comparisonsPerLookup = 0;
+    typename SegmentedFreelistAllocator<InnerNode>::Statistics innerPool;
+    typename SegmentedFreelistAllocator<LeafNode>::Statistics leafPool;
+    // only filled in if the value allocator reports statistics
+    typename SegmentedFreelistAllocator<Value>::Statistics valuePool;
+  };
 
-  void clear();
+  /**
+   * Structural report produced by analyze(). Each level counts its nodes and
+   * keys and sorts its nodes into FILL_BUCKETS buckets of equal width by the
+   * share of the N key slots they use.
+   */
+  struct Report {
+    static constexpr std::size_t FILL_BUCKETS = 10;
+
+    struct Level {
+      std::size_t nodes = 0;
+      std::size_t keys = 0;
+      std::size_t fill[FILL_BUCKETS] = {};
+    };
 
-  value_type &at(const key_type &);
+    std::vector<Level> levels; // starting at the root
+    std::size_t nodeBytes = 0;   // held by live nodes
+    std::size_t unusedBytes = 0; // of live nodes, in key and pointer slots
+    std::size_t valueBytes = 0;  // held by live values
+    std::size_t poolBytes = 0;   // reserved by the pools, including free slots
 
-  const value_type &at(const key_type &) const;
+    friend std::ostream &operator<<(std::ostream &os, const Report &report) {
+      for (std::size_t i = 0; i < report.levels.size(); i++) {
+        const Level &level = report.levels[i];
+        os << "level " << i << ": " << level.nodes << " nodes, " << level.keys
+           << " keys, fill";
 
-  iterator find(const key_type &);
+        for (std::size_t bucket : level.fill) {
+          os << ' ' << bucket;
+        }
 
-  const_iterator find(const key_type &) const;
+        os << '\n';
+      }
 
-  bool contains(const key_type &) const noexcept;
+      return os << "bytes: " << report.nodeBytes << " nodes ("
+                << report.unusedBytes << " unused), " << report.valueBytes
+                << " values, " << report.poolBytes << " reserved\n";
+    }
+  };
 
-  // =======  Iterators =======
+private:
+  // sets allocate no values, so they don't need a value allocator either
+  [[no_unique_address]] std::conditional_t<keysOnly, Empty, ValueAllocator>
+      valueAllocator;
+  SegmentedFreelistAllocator<InnerNode> innerAllocator;
+  SegmentedFreelistAllocator<LeafNode> leafAllocator;
+  Node *root = nullptr;
+  LeafNode *minNode = nullptr;
+  LeafNode *maxNode = nullptr;
+  LeafNode *insertHint = nullptr; // leaf of the last insert, tried first
+  unsigned height = 0;
+  std::size_t keyCount = 0;
+  std::size_t version = 0; // bumped whenever inner nodes may change
+  std::size_t leafMinimum = N / 2; // leaves below are rebalanced on erase
+  unsigned prefetchDistance = 2;   // leaves prefetched ahead by scans
+  bool interpolate = false;        // see set_interpolation
+  std::size_t detached = 0;        // values owned by node handles
+  std::size_t poolEpoch = 0;       // arena releases seen by the leaf pool
+  std::unique_ptr<LeafDirectory> directory; // see set_directory
+  [[no_unique_address]] mutable Stats stats;
+
+  // the directory may only be used while it has seen every change
+  bool directorySynced() const {
+    if constexpr (radixKeys) {
+      return directory && directory->version == version &&
+             !directory->leaves.empty();
+    } else {
+      return false;
+    }
+  }
 
-  iterator begin() noexcept { return iterator(minNode, 0, true); }
+  // leaf that holds key if the tree has it, null unless the directory is
+  // in sync
+  LeafNode *directoryLeaf(const key_type &key) const {
+    if constexpr (radixKeys) {
+      if (directorySynced())
+        return directory->leaves[directory->find(key)];
+    }
 
-  iterator end() noexcept { return iterator(nullptr, 0, true); }
+    return nullptr;
+  }
 
-  const_iterator begin() const noexcept { return cbegin(); }
+  void refreshDirectory();
 
-  const_iterator end() const noexcept { return cend(); }
+  bool findKeyInNode(Node *, const key_type &, std::size_t &) const;
 
-  const_iterator cbegin() const noexcept {
-    return const_iterator(minNode, 0, true);
-  }
+  std::size_t interpolationSearch(const Node *, const key_type &) const
+    requires std::is_arithmetic_v<Key>;
 
-  const_iterator cend() const noexcept {
-    return const_iterator(nullptr, 0, true);
-  }
+  template<typename KeyFwd>
+  void insertLeaf(LeafNode *, std::size_t, KeyFwd &&, value_type *);
 
-  reverse_iterator rbegin() noexcept {
-    return iterator(maxNode, maxNode->size - 1, false);
-  }
+  void removeKeyFromLeaf(LeafNode *, std::size_t);
 
-  reverse_iterator rend() noexcept { 
-    return iterator(nullptr, 0, false); 
-  }
-  
-  reverse_const_iterator rbegin() const noexcept { return crbegin(); }
+  template<typename KeyFwd>
+  void insertInner(InnerNode *, std::size_t, KeyFwd &&, Node *);
 
-  reverse_const_iterator rend() const noexcept { return crend(); }
+  void removeInnerKey(InnerNode *, std::size_t);
 
-  reverse_const_iterator crbegin() const noexcept {
-    return const_iterator(maxNode, maxNode->size - 1, false);
-  }
+  static void moveChild(InnerNode *, std::size_t, InnerNode *, std::size_t);
 
-  reverse_const_iterator crend() const noexcept {
-    return const_iterator(nullptr, 0, false);
-  }
-};
+  static void moveValue(LeafNode *, std::size_t, LeafNode *, std::size_t);
 
-// ======= IMPLEMENTATION =======
+  void refreshChild(InnerNode *, std::size_t, bool);
 
-template <typename Iterator>
-Iterator &incrementIterator(Iterator &it, bool forward) {
-  if (!it.current)
-    return it;
+  void refreshLeftSpine(InnerNode *, unsigned);
+
+  void split(InnerNode *, std::size_t, bool, bool);
+
+  void splitRoot(bool);
+
+  void rebalance(InnerNode *, std::size_t, bool);
+
+  void fixUnderflow(Cursor &, std::size_t);
+
+  void shrinkRoot();
+
+  void freeNode(Node *, bool);
+
+  bool leafCovers(const LeafNode *, const key_type &) const;
+
+  // whether a value can be assigned from args as they are
+  template <typename... Args> static constexpr bool assignableFrom() {
+    if constexpr (sizeof...(Args) == 1) {
+      return (std::is_assignable_v<value_type &, Args &&> && ...);
+    } else {
+      return false;
+    }
+  }
+
+  // value slot of a node handle, reused instead of allocating a new one
+  struct Detached {
+    value_type *value;
+  };
+
+  template <typename... Args> value_type *makeValue(Args &&...args) {
+    value_type *value = valueAllocator.allocate(1);
+    std::construct_at(value, std::forward<Args>(args)...);
+    return value;
+  }
+
+  value_type *makeValue(Detached slot) { return slot.value; }
+
+  void releaseDetached(value_type *value)
+    requires(!keysOnly)
+  {
+    std::destroy_at(value);
+    valueAllocator.deallocate(value, 1);
+    detached--;
+  }
+
+  bool remove(const key_type &, value_type **);
+
+  static auto makeValueAllocator(std::pmr::memory_resource *resource) {
+    if constexpr (keysOnly) {
+      return Empty{};
+    } else if constexpr (std::is_constructible_v<ValueAllocator, std::size_t,
+                                                 std::pmr::memory_resource *>) {
+      return ValueAllocator(256, resource);
+    } else {
+      static_assert(
+          std::is_constructible_v<ValueAllocator, std::pmr::memory_resource *>,
+          "value allocator can't draw from a memory resource");
+      return ValueAllocator(resource);
+    }
+  }
+
+  // polymorphic allocators can't be assigned, only built anew
+  template <typename Allocator>
+  static void assignAllocator(Allocator &to, const Allocator &from) {
+    if constexpr (std::is_copy_assignable_v<Allocator>) {
+      to = from;
+    } else {
+      std::destroy_at(&to);
+      std::construct_at(&to, from);
+    }
+  }
+
+  void freeNodes();
+
+  void freeSubtree(Node *, unsigned);
+
+  template <typename Found, typename... Args>
+  bool place(const key_type &, Found &, Args &&...);
+
+  template <typename Found, typename... Args>
+  bool emplaceInLeaf(LeafNode *, const key_type &, Found &, Args &&...);
+
+  template <typename Found, typename... Args>
+  bool insert(unsigned, Node *, const key_type &, Found &, Args &&...);
+
+  template <typename Iterator>
+  Iterator find(Node *, const key_type &, unsigned) const;
+
+  template <typename Iterator>
+  Iterator select(std::size_t) const;
+
+  LeafNode *lowerBoundLeaf(const key_type &, std::size_t &) const;
+
+  summary_type aggregate(Node *, unsigned, const key_type *,
+                         const key_type *) const
+    requires aggregated;
+
+  void countNodes(const Node *, unsigned, std::vector<std::size_t> &) const;
+
+  std::size_t validate(const Node *, unsigned, const key_type *,
+                       const key_type *, const LeafNode *&) const;
+
+  void analyze(const Node *, unsigned, Report &) const;
+
+  void freeValues();
+
+  template <typename Fn>
+  static void parallelChunks(std::size_t, unsigned, Fn);
+
+  template <typename Fill>
+  void bulkBuild(std::size_t, unsigned, Fill);
+
+  std::vector<LeafNode *> leafRuns(unsigned) const;
+
+  enum class SetOperation { Merge, Intersect, Difference };
+
+  // entry of a set operation's result, pointing into one of the inputs
+  using SourceEntry = std::pair<const key_type *, const value_type *>;
+
+  // position in a leaf chain, leaf is nullptr past the end
+  struct LeafPosition {
+    const LeafNode *leaf;
+    std::size_t idx;
+
+    bool before(const key_type *hi) const {
+      return leaf && (!hi || leaf->keys[idx] < *hi);
+    }
+
+    const key_type &key() const { return leaf->keys[idx]; }
+
+    const value_type *value() const {
+      if constexpr (keysOnly) {
+        return nullptr;
+      } else {
+        return leaf->values[idx];
+      }
+    }
+
+    void step(unsigned distance) {
+      if (++idx == leaf->size) {
+        leaf = leaf->next;
+        idx = 0;
+        prefetchAhead(leaf, true, distance);
+      }
+    }
+  };
+
+  LeafPosition seekForward(LeafPosition, const key_type &) const;
+
+  static void combineRange(const BPlusTree &, const BPlusTree &, SetOperation,
+                           const key_type *, const key_type *,
+                           std::vector<SourceEntry> &);
+
+  void assignCombined(const BPlusTree &, const BPlusTree &, SetOperation,
+                      unsigned);
+
+  bool sharesPools(const BPlusTree &) const;
+
+  void takePools(const BPlusTree &);
+
+  void relocate(BPlusTree &, BPlusTree &);
+
+  Node *relocate(BPlusTree &, Node *, unsigned, unsigned, LeafNode *&);
+
+  void refreshSpine(bool);
+
+  void repairSpine(bool);
+
+  // batches for sets hold plain keys, those for maps key value pairs
+  template <typename Entry>
+  static const key_type &entryKey(const Entry &entry) {
+    if constexpr (keysOnly) {
+      return entry;
+    } else {
+      return entry.first;
+    }
+  }
+
+public:
+  BPlusTree()
+      : innerAllocator(INNER_SEGMENT), leafAllocator(LEAF_SEGMENT),
+        root(nullptr){};
+
+  // values come from copies of values, e.g. a std::pmr::polymorphic_allocator
+  explicit BPlusTree(const ValueAllocator &values)
+    requires(!keysOnly)
+      : valueAllocator(values), innerAllocator(INNER_SEGMENT),
+        leafAllocator(LEAF_SEGMENT) {}
+
+  // all pools of the tree take their segments from resource
+  explicit BPlusTree(std::pmr::memory_resource *resource)
+      : valueAllocator(makeValueAllocator(resource)),
+        innerAllocator(INNER_SEGMENT, resource),
+        leafAllocator(LEAF_SEGMENT, resource) {}
+
+  // nodes and values come from the pools of arena
+  explicit BPlusTree(Arena &arena)
+      : valueAllocator(arena.values), innerAllocator(arena.inner),
+        leafAllocator(arena.leaves), poolEpoch(arena.leaves.epoch()) {}
+
+  // The pools are shared with other, which stays usable and draws from them
+  // until it is destroyed. The counters of other move along and its own start
+  // over.
+  BPlusTree(BPlusTree &&other)
+      : valueAllocator(other.valueAllocator),
+        innerAllocator(other.innerAllocator),
+        leafAllocator(other.leafAllocator), root(other.root),
+        minNode(other.minNode), maxNode(other.maxNode),
+        insertHint(other.insertHint), height(other.height),
+        keyCount(other.keyCount), version(other.version + 1),
+        leafMinimum(other.leafMinimum),
+        prefetchDistance(other.prefetchDistance),
+        interpolate(other.interpolate), detached(other.detached),
+        poolEpoch(other.poolEpoch), directory(std::move(other.directory)),
+        stats(std::exchange(other.stats, Stats())) {
+
+    if (directory) {
+      directory->leaves.clear();
+    }
+
+    other.root = nullptr;
+    other.minNode = nullptr;
+    other.maxNode = nullptr;
+    other.insertHint = nullptr;
+    other.keyCount = 0;
+    other.height = 0;
+    other.detached = 0;
+    other.version++;
+  };
+
+  BPlusTree &operator=(BPlusTree &&other) {
+    if (this == &other)
+      return *this;
+
+    clear();
+
+    if constexpr (!keysOnly) {
+      assignAllocator(valueAllocator, other.valueAllocator);
+    }
+
+    innerAllocator = other.innerAllocator;
+    leafAllocator = other.leafAllocator;
+    root = other.root;
+    minNode = other.minNode;
+    maxNode = other.maxNode;
+    insertHint = other.insertHint;
+    height = other.height;
+    keyCount = other.keyCount;
+    leafMinimum = other.leafMinimum;
+    prefetchDistance = other.prefetchDistance;
+    interpolate = other.interpolate;
+    detached = other.detached;
+    poolEpoch = other.poolEpoch;
+    directory = std::move(other.directory);
+    stats = std::exchange(other.stats, Stats());
+
+    if (directory) {
+      directory->leaves.clear();
+    }
+
+    other.root = nullptr;
+    other.minNode = nullptr;
+    other.maxNode = nullptr;
+    other.insertHint = nullptr;
+    other.keyCount = 0;
+    other.height = 0;
+    other.detached = 0;
+    other.version++;
+    // newer than anything cursors on this tree or the moved directory saw
+    version = std::max(version, other.version) + 1;
+    return *this;
+  };
+
+  BPlusTree(const BPlusTree &) = delete;
+  BPlusTree &operator=(const BPlusTree &) = delete;
+
+  ~BPlusTree() { clear(); }
+
+  std::size_t size() const { return keyCount; }
+
+  bool empty() const { return size() == 0; }
+
+  template <typename... Args> 
+  void emplace(const key_type &, Args &&...);
+
+  template <typename ValueFwd> 
+  void insert(const key_type &, ValueFwd &&);
+
+  void insert(const std::pair<key_type, value_type> &entry) {
+    insert(entry.first, entry.second);
+  }
+
+  void insert(const key_type &key)
+    requires keysOnly
+  {
+    emplace(key);
+  }
+
+  template <typename... Args>
+  bool try_emplace(const key_type &, Args &&...)
+    requires(!keysOnly);
+
+  template <typename ValueFwd>
+  bool insert_or_assign(const key_type &, ValueFwd &&)
+    requires(!keysOnly);
+
+  template <typename Fn>
+  bool upsert(const key_type &, Fn)
+    requires(!keysOnly);
+
+  template <typename ForwardIt>
+  void insert_batch(ForwardIt, ForwardIt);
+
+  node_type extract(const key_type &);
+
+  bool insert(node_type &&);
+
+  bool erase(const key_type &);
+
+  bool erase(unsigned, Node *, const key_type &, value_type ** = nullptr);
+
+  template <typename ForwardIt>
+  std::size_t erase_batch(ForwardIt, ForwardIt);
+
+  void clear();
+
+  value_type &at(const key_type &)
+    requires(!keysOnly);
+
+  const value_type &at(const key_type &) const
+    requires(!keysOnly);
+
+  iterator find(const key_type &);
+
+  const_iterator find(const key_type &) const;
+
+  bool contains(const key_type &) const noexcept;
+
+  iterator lower_bound(const key_type &);
+
+  const_iterator lower_bound(const key_type &) const;
+
+  std::size_t erase_range(const key_type &, const key_type &);
+
+  // ======= Parallel operations =======
+
+  template <typename RandomIt>
+  void bulk_load(RandomIt, RandomIt, unsigned = 0);
+
+  template <typename Fn>
+  void parallel_for_each(Fn, unsigned = 0);
+
+  // replace the contents with the union, intersection or difference of two
+  // other trees, values are taken from the first tree where both have a key
+  void merge(const BPlusTree &a, const BPlusTree &b, unsigned threads = 0) {
+    assignCombined(a, b, SetOperation::Merge, threads);
+  }
+
+  void intersect(const BPlusTree &a, const BPlusTree &b,
+                 unsigned threads = 0) {
+    assignCombined(a, b, SetOperation::Intersect, threads);
+  }
+
+  void difference(const BPlusTree &a, const BPlusTree &b,
+                  unsigned threads = 0) {
+    assignCombined(a, b, SetOperation::Difference, threads);
+  }
+
+  // ======= Split and join =======
+
+  void split_at(const key_type &, BPlusTree &);
+
+  void join(BPlusTree &);
+
+  // ======= Relaxed deletion =======
+
+  // Lets erases leave leaves with as few as minimum keys, deferring steals and
+  // merges until compact(). The minimum is clamped to [1, N / 2].
+  void set_leaf_minimum(std::size_t minimum) {
+    leafMinimum = std::clamp<std::size_t>(minimum, 1, N / 2);
+  }
+
+  std::size_t leaf_minimum() const noexcept { return leafMinimum; }
+
+  void compact();
+
+  // ======= Prefetching =======
+
+  // Sets how many leaves ahead iterators and scans prefetch, 0 turns it off.
+  // Iterators keep the distance that was set when they were created.
+  void set_prefetch_distance(unsigned distance) noexcept {
+    prefetchDistance = distance;
+  }
+
+  unsigned prefetch_distance() const noexcept { return prefetchDistance; }
+
+  // ======= Leaf directory =======
+
+  // Lets lookups of integral keys go straight to their leaf through a
+  // directory rather than down the inner nodes, which suits read-mostly trees.
+  // Leaf splits near the end of the directory, such as those of appends, are
+  // added as they happen. Other splits, erases and batch operations leave it
+  // stale until enough non-const lookups have gone by to pay for rebuilding
+  // it; const lookups never rebuild it so that they can run concurrently.
+  void set_directory(bool enabled)
+    requires radixKeys;
+
+  bool has_directory() const noexcept { return directory != nullptr; }
+
+  // ======= Interpolation =======
+
+  // Lets searches within nodes of arithmetic keys start where the line
+  // through the first and last key of the node puts the key, instead of
+  // scanning or bisecting the whole node. Worth it for wide nodes over
+  // smoothly spread keys.
+  void set_interpolation(bool enabled) noexcept
+    requires std::is_arithmetic_v<Key>
+  {
+    interpolate = enabled;
+  }
+
+  bool interpolation() const noexcept { return interpolate; }
+
+  // ======= Order statistics =======
+
+  std::size_t rank(const key_type &) const
+    requires OrderStatistics;
+
+  iterator select(std::size_t)
+    requires OrderStatistics;
+
+  const_iterator select(std::size_t) const
+    requires OrderStatistics;
+
+  std::size_t count_range(const key_type &, const key_type &) const
+    requires OrderStatistics;
+
+  // ======= Aggregates =======
+
+  summary_type aggregate(const key_type &, const key_type &) const
+    requires aggregated;
+
+  // ======= Statistics =======
+
+  Statistics statistics() const
+    requires instrumented;
+
+  void reset_statistics()
+    requires instrumented;
+
+  // ======= Diagnostics =======
+
+  void validate() const;
+
+  Report analyze() const;
+
+  // =======  Iterators =======
+
+  iterator begin() noexcept {
+    return iterator(minNode, 0, true, prefetchDistance);
+  }
+
+  iterator end() noexcept { return iterator(nullptr, 0, true); }
+
+  const_iterator begin() const noexcept { return cbegin(); }
+
+  const_iterator end() const noexcept { return cend(); }
+
+  const_iterator cbegin() const noexcept {
+    return const_iterator(minNode, 0, true, prefetchDistance);
+  }
+
+  const_iterator cend() const noexcept {
+    return const_iterator(nullptr, 0, true);
+  }
+
+  reverse_iterator rbegin() noexcept {
+    return iterator(maxNode, maxNode->size - 1, false, prefetchDistance);
+  }
+
+  reverse_iterator rend() noexcept { 
+    return iterator(nullptr, 0, false); 
+  }
+  
+  reverse_const_iterator rbegin() const noexcept { return crbegin(); }
+
+  reverse_const_iterator rend() const noexcept { return crend(); }
+
+  reverse_const_iterator crbegin() const noexcept {
+    return const_iterator(maxNode, maxNode->size - 1, false,
+                          prefetchDistance);
+  }
+
+  reverse_const_iterator crend() const noexcept {
+    return const_iterator(nullptr, 0, false);
+  }
+
+  Cursor cursor() noexcept { return Cursor(*this); }
+};
+
+// ======= IMPLEMENTATION =======
+
+template <typename Iterator>
+Iterator &incrementIterator(Iterator &it, bool forward) {
+  if (!it.current)
+    return it;
 
   if (forward) {
     if (++it.idx >= it.current->size) {
       it.current = it.current->next;
       it.idx = 0;
+      prefetchAhead(it.current, true, it.distance);
     }
   } else {
     if (it.idx == 0) {
       it.current = it.current->prev;
       it.idx = it.current ? it.current->size - 1 : 0;
+      prefetchAhead(it.current, false, it.distance);
     } else {
       it.idx--;
     }
@@ -416,13 +1500,14 @@ Iterator &incrementIterator(Iterator &it, bool forward) {
   return it;
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
 template<typename KeyFwd>
-void BPlusTree<K, V, N, Alloc>::insertInner(Node *node, std::size_t i,
-                                            KeyFwd &&key, Node *child) {
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insertInner(
+    InnerNode *node, std::size_t i, KeyFwd &&key, Node *child) {
   for (std::size_t j = node->size; j > i; j--) {
     node->keys[j] = std::move(node->keys[j - 1]);
-    node->children[j + 1] = node->children[j];
+    moveChild(node, j + 1, node, j);
   }
 
   node->keys[i] = std::forward<KeyFwd>(key);
@@ -430,67 +1515,170 @@ void BPlusTree<K, V, N, Alloc>::insertInner(Node *node, std::size_t i,
   node->size++;
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
 template<typename KeyFwd>
-void BPlusTree<K, V, N, Alloc>::insertLeaf(Node *node, std::size_t i,
-                                           KeyFwd &&key, V *value) {
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insertLeaf(
+    LeafNode *node, std::size_t i, KeyFwd &&key, V *value) {
   for (std::size_t j = node->size; j > i; j--) {
     node->keys[j] = std::move(node->keys[j - 1]);
-    node->values[j] = node->values[j - 1];
+    moveValue(node, j, node, j - 1);
   }
 
   node->keys[i] = std::forward<KeyFwd>(key);
-  node->values[i] = value;
+
+  if constexpr (!keysOnly) {
+    node->values[i] = value;
+  }
+
   node->size++;
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-void BPlusTree<K, V, N, Alloc>::removeInnerKey(Node *node, std::size_t i) {
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::removeInnerKey(
+    InnerNode *node, std::size_t i) {
   for (std::size_t j = i; j < node->size - 1; j++) {
     node->keys[j] = std::move(node->keys[j + 1]);
-    node->children[j] = node->children[j + 1];
+    moveChild(node, j, node, j + 1);
   }
 
-  node->children[node->size - 1] = node->children[node->size];
+  moveChild(node, node->size - 1, node, node->size);
   node->size--;
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-void BPlusTree<K, V, N, Alloc>::removeKeyFromLeaf(Node *node, std::size_t i) {
-  for (std::size_t j = i; j < node->size - 1; j++) {
-    node->keys[j] = std::move(node->keys[j + 1]);
-    node->values[j] = node->values[j + 1];
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::moveChild(
+    InnerNode *to, std::size_t i, InnerNode *from, std::size_t j) {
+  to->children[i] = from->children[j];
+
+  if constexpr (Ranked) {
+    to->counts[i] = from->counts[j];
   }
 
-  node->size--;
+  if constexpr (aggregated) {
+    to->summaries[i] = from->summaries[j];
+  }
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-void BPlusTree<K, V, N, Alloc>::split(Node *parent, std::size_t idx,
-                                      bool childIsLeaf) {
-  Node *left = parent->children[idx];
-  Node *right = nodeAllocator.allocate(1);
-  std::construct_at(right);
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::moveValue(
+    LeafNode *to, std::size_t i, LeafNode *from, std::size_t j) {
+  if constexpr (!keysOnly) {
+    to->values[i] = from->values[j];
+  }
+}
 
-  if (childIsLeaf) {
-    constexpr std::size_t splitIndex = (N + 1) / 2;
-    insertInner(parent, idx, left->keys[splitIndex], right);
+/**
+ * Recomputes the data kept for the child at idx after its subtree changed.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::refreshChild(
+    InnerNode *node, std::size_t idx, bool childIsLeaf) {
+  if constexpr (Ranked) {
+    Node *child = node->children[idx];
+    std::size_t count = 0;
 
-    for (std::size_t k = 0; k < splitIndex; k++) {
-      right->keys[k] = std::move(left->keys[k + splitIndex]);
-      right->values[k] = left->values[k + splitIndex];
+    if (childIsLeaf) {
+      count = child->size;
+    } else {
+      for (std::size_t i = 0; i <= child->size; i++) {
+        count += asInner(child)->counts[i];
+      }
     }
 
-    if constexpr (N % 2 == 0) {
-      right->keys[splitIndex] = std::move(left->keys[N]);
-      right->values[splitIndex] = left->values[N];
-      right->size = splitIndex + 1;
-    } else {
-      right->size = splitIndex;
+    node->counts[idx] = count;
+  }
+
+  if constexpr (aggregated) {
+    Node *child = node->children[idx];
+    summary_type summary = Agg::identity();
+
+    if (childIsLeaf) {
+      for (std::size_t i = 0; i < child->size; i++) {
+        summary = Agg::combine(summary, Agg::lift(*asLeaf(child)->values[i]));
+      }
+    } else {
+      for (std::size_t i = 0; i <= child->size; i++) {
+        summary = Agg::combine(summary, asInner(child)->summaries[i]);
+      }
+    }
+
+    node->summaries[idx] = summary;
+  }
+}
+
+/**
+ * Refreshes the first child slot of every node on the leftmost path below
+ * node, bottom up.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::refreshLeftSpine(
+    InnerNode *node, unsigned depth) {
+  bool childIsLeaf = depth + 1 >= height;
+
+  if (!childIsLeaf) {
+    refreshLeftSpine(asInner(node->children[0]), depth + 1);
+  }
+
+  refreshChild(node, 0, childIsLeaf);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::removeKeyFromLeaf(
+    LeafNode *node, std::size_t i) {
+  for (std::size_t j = i; j < node->size - 1; j++) {
+    node->keys[j] = std::move(node->keys[j + 1]);
+    moveValue(node, j, node, j + 1);
+  }
+
+  node->size--;
+}
+
+/**
+ * Splits the overflowing child at idx of parent. Leaves that overflow because
+ * of an append to the rightmost leaf are split 90/10 instead of 50/50, so that
+ * sequential inserts leave nearly full leaves behind. The right half of such a
+ * split may hold fewer than N / 2 keys, which the erase path tolerates for
+ * leaves.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::split(
+    InnerNode *parent, std::size_t idx, bool childIsLeaf,
+    bool rightmostAppend) {
+  bool synced = directorySynced();
+  version++;
+
+  if constexpr (instrumented) {
+    stats.splits++;
+  }
+
+  if (childIsLeaf) {
+    LeafNode *left = asLeaf(parent->children[idx]);
+    LeafNode *right = leafAllocator.allocate(1);
+    std::construct_at(right);
+
+    std::size_t splitIndex = rightmostAppend ? N - N / 10 : (N + 1) / 2;
+    insertInner(parent, idx, left->keys[splitIndex], right);
+
+    for (std::size_t k = splitIndex; k <= N; k++) {
+      right->keys[k - splitIndex] = std::move(left->keys[k]);
+      moveValue(right, k - splitIndex, left, k);
     }
 
+    right->size = N + 1 - splitIndex;
     left->size = splitIndex;
 
+    if (rightmostAppend) {
+      insertHint = right;
+    }
+
     right->prev = left;
     right->next = left->next;
     left->next = right;
@@ -502,21 +1690,29 @@ void BPlusTree<K, V, N, Alloc>::split(Node *parent, std::size_t idx,
       maxNode = right;
     }
 
+    if constexpr (radixKeys) {
+      synced = synced && directory->split(left, right);
+    }
+
   } else {
     // child is inner node
+    InnerNode *left = asInner(parent->children[idx]);
+    InnerNode *right = innerAllocator.allocate(1);
+    std::construct_at(right);
+
     constexpr std::size_t splitIndex = N / 2;
     insertInner(parent, idx, left->keys[splitIndex], right);
 
     for (std::size_t k = 0; k < splitIndex; k++) {
       right->keys[k] = std::move(left->keys[k + splitIndex + 1]);
-      right->children[k] = left->children[k + splitIndex + 1];
+      moveChild(right, k, left, k + splitIndex + 1);
     }
 
-    right->children[splitIndex] = left->children[2 * splitIndex + 1];
+    moveChild(right, splitIndex, left, 2 * splitIndex + 1);
 
     if constexpr (N % 2 != 0) {
       right->keys[splitIndex] = std::move(left->keys[N]);
-      right->children[splitIndex + 1] = left->children[N + 1];
+      moveChild(right, splitIndex + 1, left, N + 1);
       right->size = splitIndex + 1;
     } else {
       right->size = splitIndex;
@@ -524,447 +1720,4401 @@ void BPlusTree<K, V, N, Alloc>::split(Node *parent, std::size_t idx,
 
     left->size = splitIndex;
   }
+
+  if (synced) {
+    directory->version = version;
+  }
+
+  refreshChild(parent, idx, childIsLeaf);
+  refreshChild(parent, idx + 1, childIsLeaf);
+}
+
+/**
+ * Inserts key with a value constructed from args, or replaces the value of an
+ * existing key. A single argument the value can be assigned from is assigned
+ * without building a temporary.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename... Args>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::emplace(const K &key,
+                                                            Args &&...args) {
+  auto replace = [&](auto &value) {
+    if constexpr (assignableFrom<Args...>()) {
+      ((value = std::forward<Args>(args)), ...);
+    } else {
+      value = V(std::forward<Args>(args)...);
+    }
+  };
+
+  place(key, replace, std::forward<Args>(args)...);
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
+/**
+ * Inserts key with a value constructed from args unless the key exists, in
+ * which case nothing is constructed and args are left untouched. Returns
+ * whether key was inserted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
 template <typename... Args>
-void BPlusTree<K, V, N, Alloc>::emplace(const K &key, Args &&...args) {
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::try_emplace(
+    const K &key, Args &&...args)
+  requires(!keysOnly)
+{
+  auto keep = [](V &) {};
+  return place(key, keep, std::forward<Args>(args)...);
+}
+
+/**
+ * Inserts key with value or assigns value to the existing one. Returns whether
+ * key was inserted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename ValueFwd>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insert_or_assign(
+    const K &key, ValueFwd &&value)
+  requires(!keysOnly)
+{
+  auto assign = [&](V &existing) {
+    existing = std::forward<ValueFwd>(value);
+  };
+
+  return place(key, assign, std::forward<ValueFwd>(value));
+}
+
+/**
+ * Calls fn on the value of key in place, after inserting a value initialized
+ * one if key is missing. Takes a single descent, so read-modify-write updates
+ * such as counters need no separate find. Returns whether key was inserted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Fn>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::upsert(const K &key,
+                                                           Fn fn)
+  requires(!keysOnly)
+{
+  // builds the value of a missing key in a temporary, value initialized and
+  // passed through fn, which place() then moves into the slot of the key
+  struct Fresh {
+    Fn &fn;
+
+    operator V() const {
+      V value{};
+      fn(value);
+      return value;
+    }
+  };
+
+  return place(key, fn, Fresh{fn});
+}
+
+/**
+ * Removes key and returns a handle owning its key and value, or an empty
+ * handle if key is missing. The value is neither moved nor freed.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::node_type
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::extract(const K &key) {
+  V *value = nullptr;
+
+  // counted up front, so removing the last key can't reset the pool under
+  // the value
+  if constexpr (!keysOnly) {
+    detached++;
+  }
+
+  if (!remove(key, keysOnly ? nullptr : &value)) {
+    if constexpr (!keysOnly) {
+      detached--;
+    }
+
+    return node_type();
+  }
+
+  node_type handle(this, key);
+
+  if constexpr (!keysOnly) {
+    handle.value = value;
+  }
+
+  return handle;
+}
+
+/**
+ * Inserts the entry of handle unless its key exists, in which case handle
+ * keeps it. A value from this tree or from one with an equal allocator is
+ * linked in as it is, other values are moved into a slot of this tree.
+ * Returns whether the entry was inserted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insert(
+    node_type &&handle) {
+  if (handle.empty())
+    return false;
+
+  auto keep = [](auto &) {};
+
+  if constexpr (keysOnly) {
+    if (!place(*handle.entry, keep))
+      return false;
+
+  } else if (handle.source == this ||
+             handle.source->valueAllocator == valueAllocator) {
+    if (!place(*handle.entry, keep, Detached{handle.value}))
+      return false;
+
+    handle.source->detached--;
+
+  } else {
+    if (!place(*handle.entry, keep, std::move(*handle.value)))
+      return false;
+
+    handle.source->releaseDetached(handle.value);
+  }
+
+  handle.source = nullptr;
+  handle.entry.reset();
+  return true;
+}
+
+/**
+ * Inserts key with a value constructed from args, or calls found on the value
+ * if key exists. Returns whether key was inserted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Found, typename... Args>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::place(const K &key,
+                                                          Found &found,
+                                                          Args &&...args) {
+  if constexpr (instrumented) {
+    stats.lookups++;
+  }
+
   if (!root) {
     assert(!minNode);
 
-    V *value = valueAllocator.allocate(1);
-    std::construct_at(value, std::forward<Args>(args)...);
+    LeafNode *leaf = leafAllocator.allocate(1);
+    std::construct_at(leaf);
+
+    leaf->size = 1;
+    leaf->keys[0] = key;
+
+    if constexpr (!keysOnly) {
+      leaf->values[0] = makeValue(std::forward<Args>(args)...);
+    }
 
-    root = nodeAllocator.allocate(1);
-    std::construct_at(root);
+    root = minNode = maxNode = insertHint = leaf;
 
-    root->size = 1;
-    root->keys[0] = key;
-    root->values[0] = value;
-    minNode = maxNode = root;
+    if constexpr (radixKeys) {
+      // a directory kept in sync while the tree was empty stays so
+      if (directory && directory->version == version) {
+        directory->build(leaf, version);
+      }
+    }
 
     keyCount = 1;
     height = 1;
+    return true;
+
+  } else if (!augmented && insertHint->size < N &&
+             leafCovers(insertHint, key)) {
+    // fast path for sequential inserts, no descent needed
+    return emplaceInLeaf(insertHint, key, found, std::forward<Args>(args)...);
+
+  } else {
+    bool inserted = insert(1, root, key, found, std::forward<Args>(args)...);
+
+    if (root->size > N) {
+      splitRoot(root == maxNode && root->keys[N] == key);
+    }
+
+    return inserted;
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::splitRoot(
+    bool rightmostAppend) {
+  InnerNode *newRoot = innerAllocator.allocate(1);
+  std::construct_at(newRoot, root);
+
+  split(newRoot, 0, height <= 1, rightmostAppend);
+  root = newRoot;
+  height++;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename ValueFwd>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insert(const K &key,
+                                                           ValueFwd &&value) {
+  emplace(key, std::forward<ValueFwd>(value));
+}
+
+/**
+ * Checks whether key belongs into leaf, relying on every separator being equal
+ * to the smallest key of its right subtree.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::leafCovers(
+    const LeafNode *leaf, const K &key) const {
+  if (leaf != minNode && key < leaf->keys[0])
+    return false;
+
+  return !leaf->next || key < leaf->next->keys[0];
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Found, typename... Args>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::emplaceInLeaf(
+    LeafNode *leaf, const K &key, Found &found, Args &&...args) {
+  std::size_t idx;
+  bool inserted = !findKeyInNode(leaf, key, idx);
+
+  if (!inserted) {
+    if constexpr (!keysOnly) {
+      found(*leaf->values[idx - 1]);
+    }
+
+  } else if constexpr (keysOnly) {
+    insertLeaf(leaf, idx, key, nullptr);
+    keyCount++;
+
+  } else {
+    insertLeaf(leaf, idx, key, makeValue(std::forward<Args>(args)...));
+    keyCount++;
+  }
+
+  insertHint = leaf;
+  return inserted;
+}
+
+/**
+ * Searches keys of node. If key is found return index of right child of the
+ * key. Otherwise return index of the right child of the first key greater than
+ * the target. Nodes of up to LINEAR_SEARCH_KEYS keys are scanned, larger ones
+ * are bisected.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::findKeyInNode(
+    Node *node, const K &key, std::size_t &idx) const {
+  assert(node->size <= N);
+
+  if constexpr (std::is_arithmetic_v<K> && N > INTERPOLATION_WINDOW) {
+    if (interpolate && node->size > INTERPOLATION_WINDOW) {
+      idx = interpolationSearch(node, key);
+
+      if (idx < node->size && node->keys[idx] == key) {
+        idx++;
+        return true;
+      }
+
+      return false;
+    }
+  }
+
+  if constexpr (N <= LINEAR_SEARCH_KEYS && std::is_arithmetic_v<K>) {
+    // branchless count of smaller keys, which the compiler can vectorize
+    std::size_t smaller = 0;
+
+    for (std::size_t i = 0; i < node->size; i++) {
+      smaller += node->keys[i] < key;
+    }
+
+    if constexpr (instrumented) {
+      stats.comparisons += node->size;
+    }
+
+    idx = smaller;
+
+    if (smaller < node->size && node->keys[smaller] == key) {
+      idx++;
+      return true;
+    }
+
+  } else if constexpr (N <= LINEAR_SEARCH_KEYS) {
+    // linear search
+    for (idx = node->size; idx > 0; idx--) {
+      if constexpr (instrumented) {
+        stats.comparisons++;
+      }
+
+      if (key == node->keys[idx - 1])
+        return true;
+
+      if (key > node->keys[idx - 1])
+        break;
+    }
+
+  } else {
+    // binary search
+    std::size_t start = 0;
+    std::size_t end = node->size;
+
+    while (start < end) {
+      std::size_t pivot = start + (end - start) / 2;
+
+      if constexpr (instrumented) {
+        stats.comparisons++;
+      }
+
+      if (node->keys[pivot] == key) {
+        idx = pivot + 1;
+        return true;
+      }
+
+      else if (node->keys[pivot] < key) {
+        start = pivot + 1;
+      } else {
+        end = pivot;
+      }
+    }
+
+    idx = start;
+  }
+
+  return false;
+}
+
+/**
+ * Returns the position of the first key of node not less than key. The
+ * search starts at the position the line through the first and last key of
+ * the node predicts and gallops outwards in steps that double from one cache
+ * line of keys, then bisects the last step. For smoothly spread keys that
+ * touches about two cache lines however wide the node is.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::size_t BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::interpolationSearch(
+    const Node *node, const K &key) const
+  requires std::is_arithmetic_v<K>
+{
+  const K *keys = node->keys;
+  std::size_t last = node->size - 1;
+
+  if (!(keys[0] < key))
+    return 0;
+
+  if (keys[last] < key)
+    return node->size;
+
+  // keys[0] < key <= keys[last], so the line has a positive slope
+  double offset = static_cast<double>(key) - static_cast<double>(keys[0]);
+  double span = static_cast<double>(keys[last]) - static_cast<double>(keys[0]);
+  double fraction = offset / span;
+  std::size_t guess =
+      fraction < 1 ? static_cast<std::size_t>(fraction * last) : last;
+
+  // narrow down to [lo, hi] with keys[lo - 1] < key <= keys[hi]
+  std::size_t lo;
+  std::size_t hi;
+  std::size_t step = INTERPOLATION_WINDOW;
+  std::size_t probes = 1;
+
+  if (keys[guess] < key) {
+    lo = guess + 1;
+    hi = std::min(lo + step, last);
+
+    while (keys[hi] < key) {
+      probes++;
+      lo = hi + 1;
+      step *= 2;
+      hi = std::min(lo + step, last);
+    }
+
+  } else {
+    hi = guess;
+    lo = hi > step ? hi - step : 0;
+
+    while (lo > 0 && !(keys[lo - 1] < key)) {
+      probes++;
+      hi = lo - 1;
+      step *= 2;
+      lo = hi > step ? hi - step : 0;
+    }
+  }
+
+  while (lo < hi) {
+    probes++;
+    std::size_t pivot = lo + (hi - lo) / 2;
+
+    if (keys[pivot] < key) {
+      lo = pivot + 1;
+    } else {
+      hi = pivot;
+    }
+  }
+
+  if constexpr (instrumented) {
+    stats.comparisons += probes;
+  }
+
+  return lo;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Found, typename... Args>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insert(
+    unsigned depth, Node *node, const K &key, Found &found, Args &&...args) {
+  bool isLeaf = depth >= height;
+  bool inserted;
+
+  if (isLeaf) {
+    inserted =
+        emplaceInLeaf(asLeaf(node), key, found, std::forward<Args>(args)...);
+
+  } else {
+    std::size_t idx;
+    findKeyInNode(node, key, idx);
+
+    InnerNode *parent = asInner(node);
+    Node *child = parent->children[idx];
+    prefetchKeys(child);
+    inserted =
+        insert(depth + 1, child, key, found, std::forward<Args>(args)...);
+
+    if (child->size > N) {
+      split(parent, idx, depth + 1 >= height,
+            child == maxNode && child->keys[N] == key);
+    } else {
+      refreshChild(parent, idx, depth + 1 >= height);
+    }
+  }
+
+  assert(node->size <= N + 1);
+  return inserted;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+const V &BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::at(const K &key) const
+  requires(!keysOnly)
+{
+  const_iterator it = find(key);
+
+  if (it == cend())
+    throw std::out_of_range("key not found");
+
+  return *it;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+V &BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::at(const K &key)
+  requires(!keysOnly)
+{
+  iterator it = find(key);
+
+  if (it == end())
+    throw std::out_of_range("key not found");
+
+  return *it;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::contains(
+    const K &key) const noexcept {
+  return find<const_iterator>(root, key, 1) != cend();
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::find(const K &key) {
+  refreshDirectory();
+  return find<iterator>(root, key, 1);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::const_iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::find(const K &key) const {
+  return find<const_iterator>(root, key, 1);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Iterator>
+Iterator BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::find(
+    Node *node, const K &key, unsigned depth) const {
+  if (!root)
+    return Iterator();
+
+  if (depth == 1) {
+    if constexpr (instrumented) {
+      stats.lookups++;
+    }
+
+    if (LeafNode *leaf = directoryLeaf(key)) {
+      node = leaf;
+      depth = height;
+    }
+  }
+
+  bool isLeaf = depth >= height;
+
+  std::size_t idx;
+  bool found = findKeyInNode(node, key, idx);
+
+  if (isLeaf) {
+    if (found) {
+      return Iterator(asLeaf(node), idx - 1, true, prefetchDistance);
+    } else {
+      return Iterator();
+    }
+
+  } else {
+    Node *child = asInner(node)->children[idx];
+    prefetchKeys(child);
+    return find<Iterator>(child, key, depth + 1);
+  }
+}
+
+/**
+ * Returns the leaf and position of the first key not less than key. The
+ * position equals the leaf's size if all keys of the leaf are smaller, in
+ * which case the first key of the next leaf is the one sought.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::LeafNode *
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::lowerBoundLeaf(
+    const K &key, std::size_t &idx) const {
+  Node *node = root;
+  unsigned depth = 1;
+
+  if (LeafNode *leaf = directoryLeaf(key)) {
+    node = leaf;
+    depth = height;
+  }
+
+  for (; depth < height; depth++) {
+    findKeyInNode(node, key, idx);
+    node = asInner(node)->children[idx];
+    prefetchKeys(node);
+  }
+
+  if (findKeyInNode(node, key, idx)) {
+    idx--;
+  }
+
+  return asLeaf(node);
+}
+
+/**
+ * Rebuilds a stale directory once it has been missed by about as many
+ * lookups as the tree has leaves, so the walk over the leaf chain costs each
+ * lookup a constant.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::refreshDirectory() {
+  if constexpr (radixKeys) {
+    if (!directory || !root || directorySynced())
+      return;
+
+    if (++directory->staleLookups * N < size())
+      return;
+
+    directory->build(minNode, version);
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::set_directory(
+    bool enabled)
+  requires radixKeys
+{
+  if (!enabled) {
+    directory.reset();
+    return;
+  }
+
+  if (!directory) {
+    directory = std::make_unique<LeafDirectory>();
+  }
+
+  if (!directorySynced()) {
+    directory->build(minNode, version);
+  }
+}
+
+/**
+ * Returns an iterator to the first key not less than key.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::lower_bound(const K &key) {
+  if (!root)
+    return end();
+
+  refreshDirectory();
+
+  std::size_t idx;
+  LeafNode *leaf = lowerBoundLeaf(key, idx);
+
+  if (idx == leaf->size)
+    return iterator(leaf->next, 0, true, prefetchDistance);
+
+  return iterator(leaf, idx, true, prefetchDistance);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::const_iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::lower_bound(
+    const K &key) const {
+  if (!root)
+    return cend();
+
+  std::size_t idx;
+  LeafNode *leaf = lowerBoundLeaf(key, idx);
+
+  if (idx == leaf->size)
+    return const_iterator(leaf->next, 0, true, prefetchDistance);
+
+  return const_iterator(leaf, idx, true, prefetchDistance);
+}
+
+/**
+ * Returns the number of keys smaller than key.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::size_t BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::rank(
+    const K &key) const
+  requires Ranked
+{
+  if (!root)
+    return 0;
+
+  std::size_t smaller = 0;
+  Node *node = root;
+  std::size_t idx;
+
+  for (unsigned depth = 1; depth < height; depth++) {
+    findKeyInNode(node, key, idx);
+
+    for (std::size_t i = 0; i < idx; i++) {
+      smaller += asInner(node)->counts[i];
+    }
+
+    node = asInner(node)->children[idx];
+  }
+
+  bool found = findKeyInNode(node, key, idx);
+  return smaller + (found ? idx - 1 : idx);
+}
+
+/**
+ * Returns an iterator to the k-th smallest key, counting from zero.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::select(std::size_t k)
+  requires Ranked
+{
+  return select<iterator>(k);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::const_iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::select(std::size_t k) const
+  requires Ranked
+{
+  return select<const_iterator>(k);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Iterator>
+Iterator BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::select(
+    std::size_t k) const {
+  if (k >= size())
+    return Iterator();
+
+  Node *node = root;
+
+  for (unsigned depth = 1; depth < height; depth++) {
+    const InnerNode *parent = asInner(node);
+    std::size_t i = 0;
+
+    while (k >= parent->counts[i]) {
+      k -= parent->counts[i];
+      i++;
+    }
+
+    node = parent->children[i];
+  }
+
+  return Iterator(asLeaf(node), k, true, prefetchDistance);
+}
+
+/**
+ * Returns the number of keys in [lo, hi).
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::size_t
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::count_range(const K &lo,
+                                                           const K &hi) const
+  requires Ranked
+{
+  if (!(lo < hi))
+    return 0;
+
+  return rank(hi) - rank(lo);
+}
+
+/**
+ * Combines the values of all keys in [lo, hi).
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::summary_type
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::aggregate(const K &lo,
+                                                         const K &hi) const
+  requires aggregated
+{
+  if (!root || !(lo < hi))
+    return Agg::identity();
+
+  return aggregate(root, 1, &lo, &hi);
+}
+
+/**
+ * Combines the values below node that lie within the given bounds, nullptr
+ * meaning unbounded. Children fully inside the bounds contribute their stored
+ * summary, so only the paths to lo and hi are descended.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::summary_type
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::aggregate(Node *node,
+                                                         unsigned depth,
+                                                         const K *lo,
+                                                         const K *hi) const
+  requires aggregated
+{
+  summary_type summary = Agg::identity();
+
+  if (depth >= height) {
+    for (std::size_t i = 0; i < node->size; i++) {
+      if (hi && !(node->keys[i] < *hi))
+        break;
+
+      if (!lo || !(node->keys[i] < *lo)) {
+        summary = Agg::combine(summary, Agg::lift(*asLeaf(node)->values[i]));
+      }
+    }
+
+    return summary;
+  }
+
+  std::size_t first = 0;
+  std::size_t last = node->size;
+
+  if (lo) {
+    findKeyInNode(node, *lo, first);
+  }
+
+  if (hi) {
+    findKeyInNode(node, *hi, last);
+  }
+
+  const InnerNode *parent = asInner(node);
+
+  if (first == last)
+    return aggregate(parent->children[first], depth + 1, lo, hi);
+
+  summary = aggregate(parent->children[first], depth + 1, lo, nullptr);
+
+  for (std::size_t i = first + 1; i < last; i++) {
+    summary = Agg::combine(summary, parent->summaries[i]);
+  }
+
+  return Agg::combine(
+      summary, aggregate(parent->children[last], depth + 1, nullptr, hi));
+}
+
+/**
+ * Collects the counters and walks all inner nodes to report the shape of the
+ * tree, so this takes time linear in the number of inner nodes.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Statistics
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::statistics() const
+  requires instrumented
+{
+  Statistics result;
+  result.counters = stats;
+  result.nodesPerLevel.assign(height, 0);
+
+  if (root) {
+    countNodes(root, 1, result.nodesPerLevel);
+
+    std::size_t leaves = result.nodesPerLevel.back();
+    result.leafFill = static_cast<double>(size()) / (leaves * N);
+  }
+
+  if (stats.lookups > 0) {
+    result.comparisonsPerLookup =
+        static_cast<double>(stats.comparisons) / stats.lookups;
+  }
+
+  result.innerPool = innerAllocator.statistics();
+  result.leafPool = leafAllocator.statistics();
+
+  if constexpr (requires { valueAllocator.statistics(); }) {
+    result.valuePool = valueAllocator.statistics();
+  }
+
+  return result;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::reset_statistics()
+  requires instrumented
+{
+  stats = Stats();
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::countNodes(
+    const Node *node, unsigned depth,
+    std::vector<std::size_t> &nodesPerLevel) const {
+  nodesPerLevel[depth - 1]++;
+
+  if (depth >= height)
+    return;
+
+  if (depth + 1 == height) {
+    // children are leaves, no need to visit them
+    nodesPerLevel[depth] += node->size + 1;
+    return;
+  }
+
+  for (std::size_t i = 0; i <= node->size; i++) {
+    countNodes(asInner(node)->children[i], depth + 1, nodesPerLevel);
+  }
+}
+
+/**
+ * Erases all keys in [lo, hi) and returns how many were erased. The keys are
+ * gathered along the leaf chain and then removed as one batch.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::size_t BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::erase_range(
+    const K &lo, const K &hi) {
+  if (!root || !(lo < hi))
+    return 0;
+
+  std::vector<K> keys;
+  std::size_t idx;
+
+  for (LeafNode *leaf = lowerBoundLeaf(lo, idx); leaf;
+       leaf = leaf->next, idx = 0) {
+    for (; idx < leaf->size; idx++) {
+      if (!(leaf->keys[idx] < hi))
+        return erase_batch(keys.begin(), keys.end());
+
+      keys.push_back(leaf->keys[idx]);
+    }
+  }
+
+  return erase_batch(keys.begin(), keys.end());
+}
+
+/**
+ * Checks the structural invariants of the tree and throws std::logic_error
+ * describing the first one that is violated.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::validate() const {
+  if (!root) {
+    if (keyCount != 0 || height != 0 || minNode || maxNode)
+      throw std::logic_error("empty tree has keys or nodes");
+
+    return;
+  }
+
+  if (minNode->prev)
+    throw std::logic_error("first leaf has a predecessor");
+
+  const LeafNode *lastLeaf = nullptr;
+  std::size_t keys = validate(root, 1, nullptr, nullptr, lastLeaf);
+
+  if (lastLeaf != maxNode || maxNode->next)
+    throw std::logic_error("leaf chain does not end at the last leaf");
+
+  if (keys != keyCount)
+    throw std::logic_error("key count differs from keys in leaves");
+
+  if constexpr (radixKeys) {
+    if (!directorySynced())
+      return;
+
+    const LeafNode *leaf = minNode;
+
+    for (std::size_t i = 0; i < directory->leaves.size(); i++) {
+      if (directory->leaves[i] != leaf ||
+          (i > 0 && (!(directory->firstKeys[i - 1] == leaf->keys[0]) ||
+                     directory->find(leaf->keys[0]) != i)))
+        throw std::logic_error("directory differs from the leaf chain");
+
+      leaf = leaf->next;
+    }
+
+    if (leaf)
+      throw std::logic_error("directory misses leaves");
+  }
+}
+
+/**
+ * Validates the subtree of node, whose keys must lie in [lo, hi), and returns
+ * the number of keys in it. lastLeaf is the leaf preceding the subtree in key
+ * order, which the leaves are checked to follow in the leaf chain.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::size_t BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::validate(
+    const Node *node, unsigned depth, const K *lo, const K *hi,
+    const LeafNode *&lastLeaf) const {
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  if (node->size > N)
+    throw std::logic_error("node overflows");
+
+  for (std::size_t i = 0; i < node->size; i++) {
+    if (i > 0 && !(node->keys[i - 1] < node->keys[i]))
+      throw std::logic_error("keys out of order");
+
+    if ((lo && node->keys[i] < *lo) || (hi && !(node->keys[i] < *hi)))
+      throw std::logic_error("key outside of its separators");
+  }
+
+  if (depth >= height) {
+    // leaves may be underfull but never empty
+    if (node->size == 0)
+      throw std::logic_error("empty leaf");
+
+    if (lo && !(node->keys[0] == *lo))
+      throw std::logic_error("separator is not the smallest key to its right");
+
+    const LeafNode *leaf = asLeaf(node);
+
+    if (leaf->prev != lastLeaf || (lastLeaf ? lastLeaf->next : minNode) != leaf)
+      throw std::logic_error("leaf chain out of order or leaf depths differ");
+
+    lastLeaf = leaf;
+    return leaf->size;
+  }
+
+  if (node != root && node->size < MIN_KEYS)
+    throw std::logic_error("inner node underflows");
+
+  if (node->size == 0)
+    throw std::logic_error("inner node without keys");
+
+  const InnerNode *parent = asInner(node);
+  std::size_t keys = 0;
+
+  for (std::size_t i = 0; i <= node->size; i++) {
+    const K *childLo = i > 0 ? &node->keys[i - 1] : lo;
+    const K *childHi = i < node->size ? &node->keys[i] : hi;
+    std::size_t childKeys =
+        validate(parent->children[i], depth + 1, childLo, childHi, lastLeaf);
+
+    if constexpr (Ranked) {
+      if (parent->counts[i] != childKeys)
+        throw std::logic_error("stored subtree count is stale");
+    }
+
+    keys += childKeys;
+  }
+
+  return keys;
+}
+
+/**
+ * Reports the shape and memory use of the tree. Inner nodes are visited
+ * recursively and leaves along the leaf chain, in one pass.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Report
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::analyze() const {
+  Report report;
+  report.levels.resize(height);
+
+  if (height > 1) {
+    analyze(root, 1, report);
+  }
+
+  for (const LeafNode *leaf = minNode; leaf; leaf = leaf->next) {
+    analyze(leaf, height, report);
+  }
+
+  if constexpr (!keysOnly) {
+    report.valueBytes = size() * sizeof(V);
+  }
+
+  report.poolBytes = innerAllocator.statistics().bytes +
+                     leafAllocator.statistics().bytes;
+
+  if constexpr (requires { valueAllocator.statistics(); }) {
+    report.poolBytes += valueAllocator.statistics().bytes;
+  }
+
+  return report;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::analyze(
+    const Node *node, unsigned depth, Report &report) const {
+  typename Report::Level &level = report.levels[depth - 1];
+  level.nodes++;
+  level.keys += node->size;
+  level.fill[std::min(node->size * Report::FILL_BUCKETS / N,
+                      Report::FILL_BUCKETS - 1)]++;
+
+  std::size_t unusedSlots = N + 1 - node->size;
+
+  if (depth >= height) {
+    report.nodeBytes += sizeof(LeafNode);
+    report.unusedBytes +=
+        unusedSlots * (sizeof(K) + (keysOnly ? 0 : sizeof(V *)));
+    return;
+  }
+
+  report.nodeBytes += sizeof(InnerNode);
+  report.unusedBytes += unusedSlots * (sizeof(K) + sizeof(Node *));
+
+  // leaves are visited along the leaf chain instead
+  if (depth + 1 < height) {
+    for (std::size_t i = 0; i <= node->size; i++) {
+      analyze(asInner(node)->children[i], depth + 1, report);
+    }
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::erase(const K &key) {
+  return remove(key, nullptr);
+}
+
+/**
+ * Removes key from the tree. Unless released is null the value is not freed
+ * but handed over through it.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::remove(const K &key,
+                                                           V **released) {
+  if (!root)
+    return false;
+
+  if constexpr (instrumented) {
+    stats.lookups++;
+  }
+
+  if (height == 1 && root->size == 1 && root->keys[0] == key) {
+    assert(minNode == root);
+    assert(minNode->next == nullptr);
+
+    if constexpr (!keysOnly) {
+      if (released) {
+        // keep clear() from freeing the value
+        *released = minNode->values[0];
+        minNode->size = 0;
+      }
+    }
+
+    clear();
+    return true;
+  }
+
+  bool retval = erase(1, root, key, released);
+
+  // a miss leaves the inner nodes as they are
+  if (retval) {
+    version++;
+    shrinkRoot();
+    keyCount--;
+  }
+
+  return retval;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::shrinkRoot() {
+  // check if height needs to shrink
+  if (height > 1 && root->size == 0) {
+    Node *newRoot = asInner(root)->children[0];
+    freeNode(root, false);
+    root = newRoot;
+    height--;
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::freeNode(Node *node,
+                                                             bool isLeaf) {
+  if (isLeaf) {
+    std::destroy_at(asLeaf(node));
+    leafAllocator.deallocate(asLeaf(node), 1);
+  } else {
+    std::destroy_at(asInner(node));
+    innerAllocator.deallocate(asInner(node), 1);
+  }
+}
+
+/**
+ * Inserts a run of entries sorted by ascending, unique keys. Each leaf the run
+ * touches is found with a single descent and all of its new entries are merged
+ * in with one pass over the leaf. Overflow is resolved with one upward pass
+ * along the descent path.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename ForwardIt>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::insert_batch(
+    ForwardIt first, ForwardIt last) {
+  Cursor cursor(*this);
+
+  while (first != last) {
+    if (!root) {
+      auto &&entry = *first;
+
+      if constexpr (keysOnly) {
+        emplace(entry);
+      } else {
+        emplace(entry.first, std::forward<decltype(entry)>(entry).second);
+      }
+
+      ++first;
+      continue;
+    }
+
+    LeafNode *leaf = cursor.seekLeaf(entryKey(*first));
+    const K *hi = cursor.path.back().hi;
+    std::size_t oldSize = leaf->size;
+    bool rightmostAppend =
+        leaf == maxNode && leaf->keys[oldSize - 1] < entryKey(*first);
+
+    // take as much of the run as fits into the leaf and count the new keys
+    std::size_t added = 0;
+    std::size_t i = 0;
+    ForwardIt runEnd = first;
+
+    while (runEnd != last && added <= N - oldSize &&
+           (!hi || entryKey(*runEnd) < *hi)) {
+      const K &key = entryKey(*runEnd);
+      assert(runEnd == first || entryKey(*first) < key);
+
+      while (i < oldSize && leaf->keys[i] < key) {
+        i++;
+      }
+
+      if (i == oldSize || !(leaf->keys[i] == key)) {
+        added++;
+      }
+
+      ++runEnd;
+    }
+
+    // shift the old entries to the back once, then merge from the front
+    for (std::size_t j = oldSize; j > 0; j--) {
+      leaf->keys[j - 1 + added] = std::move(leaf->keys[j - 1]);
+      moveValue(leaf, j - 1 + added, leaf, j - 1);
+    }
+
+    std::size_t r = added;
+    std::size_t w = 0;
+    std::size_t end = oldSize + added;
+
+    for (; first != runEnd; ++first) {
+      auto &&entry = *first;
+      const K &key = entryKey(entry);
+
+      for (; r < end && leaf->keys[r] < key; r++, w++) {
+        if (r != w) {
+          leaf->keys[w] = std::move(leaf->keys[r]);
+          moveValue(leaf, w, leaf, r);
+        }
+      }
+
+      if (r < end && leaf->keys[r] == key) {
+        // replace
+        if constexpr (!keysOnly) {
+          *leaf->values[r] = std::forward<decltype(entry)>(entry).second;
+        }
+
+        if (r != w) {
+          leaf->keys[w] = std::move(leaf->keys[r]);
+          moveValue(leaf, w, leaf, r);
+        }
+
+        r++;
+
+      } else {
+        leaf->keys[w] = key;
+
+        if constexpr (!keysOnly) {
+          V *value = valueAllocator.allocate(1);
+          std::construct_at(value,
+                            std::forward<decltype(entry)>(entry).second);
+          leaf->values[w] = value;
+        }
+      }
+
+      w++;
+    }
+
+    assert(r == w);
+    leaf->size = end;
+    keyCount += added;
+    insertHint = leaf;
+
+    // split overflowing nodes bottom up along the path
+    auto &path = cursor.path;
+    for (std::size_t level = path.size() - 1; level > 0; level--) {
+      bool childIsLeaf = level == path.size() - 1;
+
+      InnerNode *parent = asInner(path[level - 1].node);
+
+      if (path[level].node->size > N) {
+        split(parent, path[level].idx, childIsLeaf,
+              childIsLeaf && rightmostAppend);
+      } else if (augmented) {
+        refreshChild(parent, path[level].idx, childIsLeaf);
+      } else {
+        break;
+      }
+    }
+
+    if (root->size > N) {
+      splitRoot(height <= 1 && rightmostAppend);
+    }
+  }
+}
+
+/**
+ * Erases a run of keys sorted in ascending order and returns the number of
+ * erased entries. Like insert_batch, every touched leaf is compacted in one
+ * pass and the resulting underflow is fixed in one upward pass.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename ForwardIt>
+std::size_t BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::erase_batch(
+    ForwardIt first, ForwardIt last) {
+  Cursor cursor(*this);
+  std::size_t erased = 0;
+
+  while (first != last && root) {
+    LeafNode *leaf = cursor.seekLeaf(*first);
+    auto &path = cursor.path;
+    K *lo = path.back().lo;
+    K *hi = path.back().hi;
+
+    // remove all keys of the run that fall into this leaf
+    std::size_t r = 0;
+    std::size_t w = 0;
+
+    for (; first != last && (!hi || *first < *hi); ++first) {
+      for (; r < leaf->size && leaf->keys[r] < *first; r++, w++) {
+        if (r != w) {
+          leaf->keys[w] = std::move(leaf->keys[r]);
+          moveValue(leaf, w, leaf, r);
+        }
+      }
+
+      if (r < leaf->size && leaf->keys[r] == *first) {
+        if constexpr (!keysOnly) {
+          std::destroy_at(leaf->values[r]);
+          valueAllocator.deallocate(leaf->values[r], 1);
+        }
+
+        r++;
+      }
+    }
+
+    for (; r < leaf->size; r++, w++) {
+      if (r != w) {
+        leaf->keys[w] = std::move(leaf->keys[r]);
+        moveValue(leaf, w, leaf, r);
+      }
+    }
+
+    std::size_t removed = leaf->size - w;
+    leaf->size = w;
+    keyCount -= removed;
+    erased += removed;
+
+    if (removed == 0)
+      continue;
+
+    version++;
+
+    if (leaf == root && leaf->size == 0) {
+      clear();
+      break;
+    }
+
+    // keep separators equal to the first key of their right subtree
+    if (lo && leaf->size > 0) {
+      *lo = leaf->keys[0];
+    }
+
+    fixUnderflow(cursor, leafMinimum);
+    shrinkRoot();
+  }
+
+  return erased;
+}
+
+/**
+ * Fixes underflow bottom up along the path of the cursor's last seek. The leaf
+ * at its end is rebalanced if it holds fewer than leafMin keys, inner nodes if
+ * they hold fewer than N / 2.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::fixUnderflow(
+    Cursor &cursor, std::size_t leafMin) {
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  auto &path = cursor.path;
+  LeafNode *leaf = asLeaf(path.back().node);
+  K *lo = path.back().lo;
+
+  for (std::size_t level = path.size() - 1; level > 0; level--) {
+    Node *node = path[level].node;
+    InnerNode *parent = asInner(path[level - 1].node);
+    std::size_t idx = path[level].idx;
+    bool isLeaf = level == path.size() - 1;
+
+    if (node->size >= (isLeaf ? leafMin : MIN_KEYS)) {
+      if (!augmented)
+        break;
+
+      refreshChild(parent, idx, isLeaf);
+      continue;
+    }
+
+    rebalance(parent, idx, isLeaf);
+
+    // a leftmost child may have received a new first key from its sibling
+    if (node == leaf && idx == 0 && lo && parent->children[0] == leaf) {
+      *lo = leaf->keys[0];
+    }
+  }
+}
+
+/**
+ * Brings every leaf that relaxed erases left below N / 2 keys back to half
+ * fill by stealing from or merging with its siblings. Inner nodes are always
+ * kept at half fill, so they need no maintenance.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::compact() {
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  // keys stay put in the tree while leaves merge, leaf pointers don't
+  std::vector<K> underfull;
+  for (LeafNode *leaf = minNode; leaf && height > 1; leaf = leaf->next) {
+    if (leaf->size < MIN_KEYS) {
+      underfull.push_back(leaf->keys[0]);
+    }
+  }
+
+  Cursor cursor(*this);
+
+  for (const K &key : underfull) {
+    if (height <= 1)
+      break;
+
+    if (cursor.seekLeaf(key)->size >= MIN_KEYS)
+      continue;
+
+    version++;
+    fixUnderflow(cursor, MIN_KEYS);
+    shrinkRoot();
+  }
+}
+
+/**
+ * Splits count items into contiguous chunks and runs fn(begin, end) on each,
+ * one chunk per thread. The calling thread takes the first chunk.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Fn>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::parallelChunks(
+    std::size_t count, unsigned threads, Fn fn) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::size_t chunks = std::min<std::size_t>(threads, count);
+  std::vector<std::thread> workers;
+
+  for (std::size_t t = 1; t < chunks; t++) {
+    workers.emplace_back(fn, count * t / chunks, count * (t + 1) / chunks);
+  }
+
+  if (chunks > 0) {
+    fn(0, count / chunks);
+  }
+
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+/**
+ * Replaces the contents of the tree with a run of entries sorted by ascending,
+ * unique keys. Keys and values must not throw while being copied or moved.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename RandomIt>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::bulk_load(
+    RandomIt first, RandomIt last, unsigned threads) {
+  clear();
+
+  bulkBuild(last - first, threads,
+            [first](std::size_t i, K &key, [[maybe_unused]] V *value) {
+              auto &&entry = first[i];
+              key = entryKey(entry);
+
+              if constexpr (!keysOnly) {
+                std::construct_at(value,
+                                  std::forward<decltype(entry)>(entry).second);
+              }
+            });
+}
+
+/**
+ * Builds an empty tree bottom up from count entries, where fill(i, key, value)
+ * assigns the key of the i-th entry and constructs its value in place. Nodes
+ * and values are allocated up front on the calling thread, since the pools
+ * aren't thread safe. Filling the leaves and building each upper level is
+ * then split across threads.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Fill>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::bulkBuild(
+    std::size_t count, unsigned threads, Fill fill) {
+  assert(!root);
+
+  if (count == 0)
+    return;
+
+  // spread keys evenly, which leaves every leaf but a lone root half full
+  std::size_t leafCount = (count + N - 1) / N;
+  std::vector<Node *> level(leafCount);
+
+  for (std::size_t i = 0; i < leafCount; i++) {
+    LeafNode *leaf = leafAllocator.allocate(1);
+    std::construct_at(leaf);
+    leaf->size = count * (i + 1) / leafCount - count * i / leafCount;
+
+    if constexpr (!keysOnly) {
+      for (std::size_t j = 0; j < leaf->size; j++) {
+        leaf->values[j] = valueAllocator.allocate(1);
+      }
+    }
+
+    level[i] = leaf;
+  }
+
+  parallelChunks(leafCount, threads, [&](std::size_t begin, std::size_t end) {
+    for (std::size_t i = begin; i < end; i++) {
+      LeafNode *leaf = asLeaf(level[i]);
+      leaf->prev = i > 0 ? asLeaf(level[i - 1]) : nullptr;
+      leaf->next = i + 1 < leafCount ? asLeaf(level[i + 1]) : nullptr;
+
+      std::size_t from = count * i / leafCount;
+
+      for (std::size_t j = 0; j < leaf->size; j++) {
+        if constexpr (keysOnly) {
+          fill(from + j, leaf->keys[j], nullptr);
+        } else {
+          fill(from + j, leaf->keys[j], leaf->values[j]);
+        }
+      }
+    }
+  });
+
+  minNode = asLeaf(level.front());
+  maxNode = insertHint = asLeaf(level.back());
+  height = 1;
+
+  // build the upper levels bottom up, again spreading children evenly
+  while (level.size() > 1) {
+    std::size_t parentCount = (level.size() + N) / (N + 1);
+    std::vector<Node *> parents(parentCount);
+    bool childIsLeaf = height == 1;
+
+    for (Node *&parent : parents) {
+      parent = std::construct_at(innerAllocator.allocate(1));
+    }
+
+    parallelChunks(parentCount, threads, [&](std::size_t begin,
+                                             std::size_t end) {
+      for (std::size_t i = begin; i < end; i++) {
+        InnerNode *parent = asInner(parents[i]);
+        std::size_t from = level.size() * i / parentCount;
+        std::size_t to = level.size() * (i + 1) / parentCount;
+        parent->size = to - from - 1;
+
+        for (std::size_t j = 0; j < to - from; j++) {
+          parent->children[j] = level[from + j];
+
+          if (j > 0) {
+            Node *lowest = level[from + j];
+
+            for (unsigned depth = 1; depth < height; depth++) {
+              lowest = asInner(lowest)->children[0];
+            }
+
+            parent->keys[j - 1] = lowest->keys[0];
+          }
+
+          refreshChild(parent, j, childIsLeaf);
+        }
+      }
+    });
+
+    level = std::move(parents);
+    height++;
+  }
+
+  root = level.front();
+  keyCount = count;
+  version++;
+}
+
+/**
+ * Cuts the leaf chain into runs and returns their first leaves. The runs are
+ * the subtrees of the highest level that gives every thread a few of them.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+std::vector<typename BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::LeafNode *>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::leafRuns(
+    unsigned threads) const {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  std::vector<Node *> frontier{root};
+  unsigned depth = 1;
+
+  while (depth < height && frontier.size() < 4 * threads) {
+    std::vector<Node *> children;
+
+    for (Node *node : frontier) {
+      for (std::size_t i = 0; i <= node->size; i++) {
+        children.push_back(asInner(node)->children[i]);
+      }
+    }
+
+    frontier = std::move(children);
+    depth++;
+  }
+
+  std::vector<LeafNode *> starts;
+
+  for (Node *node : frontier) {
+    for (unsigned d = depth; d < height; d++) {
+      node = asInner(node)->children[0];
+    }
+
+    starts.push_back(asLeaf(node));
+  }
+
+  return starts;
+}
+
+/**
+ * Calls fn(key, value), or fn(key) for sets, on every entry in parallel. Each
+ * thread walks a contiguous share of the leaf runs. The order of calls is
+ * unspecified.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename Fn>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::parallel_for_each(
+    Fn fn, unsigned threads) {
+  if (!root)
+    return;
+
+  std::vector<LeafNode *> starts = leafRuns(threads);
+
+  parallelChunks(starts.size(), threads, [&](std::size_t begin,
+                                             std::size_t end) {
+    LeafNode *stop = end < starts.size() ? starts[end] : nullptr;
+
+    for (LeafNode *leaf = starts[begin]; leaf != stop; leaf = leaf->next) {
+      prefetchAhead(leaf, true, prefetchDistance);
+
+      for (std::size_t i = 0; i < leaf->size; i++) {
+        if constexpr (keysOnly) {
+          fn(std::as_const(leaf->keys[i]));
+        } else {
+          fn(std::as_const(leaf->keys[i]), *leaf->values[i]);
+        }
+      }
+    }
+  });
+}
+
+/**
+ * Moves pos forward to the first key not less than key. Targets within the
+ * current or next leaf are reached along the leaf chain, farther ones with a
+ * descent from the root that skips the subtrees in between.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::LeafPosition
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::seekForward(
+    LeafPosition pos, const K &key) const {
+  const LeafNode *leaf = pos.leaf;
+
+  if (leaf->keys[leaf->size - 1] < key) {
+    leaf = leaf->next;
+
+    if (!leaf)
+      return {nullptr, 0};
+
+    if (leaf->keys[leaf->size - 1] < key) {
+      std::size_t idx;
+      leaf = lowerBoundLeaf(key, idx);
+      pos = {leaf, idx};
+
+      if (idx == leaf->size) {
+        pos = {leaf->next, 0};
+      }
+
+      return pos;
+    }
+
+    pos = {leaf, 0};
+  }
+
+  while (pos.key() < key) {
+    pos.idx++;
+  }
+
+  return pos;
+}
+
+/**
+ * Co-iterates the keys of a and b in [lo, hi) and appends the result of op to
+ * out. Keys of one tree that have no counterpart in the other are skipped with
+ * seekForward where op drops them.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::combineRange(
+    const BPlusTree &a, const BPlusTree &b, SetOperation op, const K *lo,
+    const K *hi, std::vector<SourceEntry> &out) {
+  auto start = [lo](const BPlusTree &tree) -> LeafPosition {
+    if (!tree.root)
+      return {nullptr, 0};
+
+    LeafPosition pos = {tree.minNode, 0};
+    return lo ? tree.seekForward(pos, *lo) : pos;
+  };
+
+  LeafPosition pa = start(a);
+  LeafPosition pb = start(b);
+
+  while (pa.before(hi) && pb.before(hi)) {
+    if (pa.key() < pb.key()) {
+      if (op == SetOperation::Intersect) {
+        pa = a.seekForward(pa, pb.key());
+        continue;
+      }
+
+      out.push_back({&pa.key(), pa.value()});
+      pa.step(a.prefetchDistance);
+
+    } else if (pb.key() < pa.key()) {
+      if (op != SetOperation::Merge) {
+        pb = b.seekForward(pb, pa.key());
+        continue;
+      }
+
+      out.push_back({&pb.key(), pb.value()});
+      pb.step(b.prefetchDistance);
+
+    } else {
+      if (op != SetOperation::Difference) {
+        out.push_back({&pa.key(), pa.value()});
+      }
+
+      pa.step(a.prefetchDistance);
+      pb.step(b.prefetchDistance);
+    }
+  }
+
+  // whatever is left of one tree has no counterpart in the other
+  for (; op != SetOperation::Intersect && pa.before(hi);
+       pa.step(a.prefetchDistance)) {
+    out.push_back({&pa.key(), pa.value()});
+  }
+
+  for (; op == SetOperation::Merge && pb.before(hi);
+       pb.step(b.prefetchDistance)) {
+    out.push_back({&pb.key(), pb.value()});
+  }
+}
+
+/**
+ * Replaces the contents of the tree with the result of op on a and b. The key
+ * space is partitioned at the leaf runs of the larger input, the partitions
+ * are combined in parallel and the results feed a bottom-up build.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::assignCombined(
+    const BPlusTree &a, const BPlusTree &b, SetOperation op, unsigned threads) {
+  assert(this != &a && this != &b);
+  clear();
+
+  if constexpr (instrumented) {
+    threads = 1; // lookups bump counters that aren't atomic
+  }
+
+  const BPlusTree &larger = a.size() < b.size() ? b : a;
+  if (!larger.root)
+    return;
+
+  std::vector<const K *> bounds;
+
+  for (const LeafNode *leaf : larger.leafRuns(threads)) {
+    bounds.push_back(&leaf->keys[0]);
+  }
+
+  // the partition of chunk [begin, end) is [bounds[begin], bounds[end])
+  std::vector<std::vector<SourceEntry>> parts(bounds.size());
+
+  parallelChunks(bounds.size(), threads, [&](std::size_t begin,
+                                             std::size_t end) {
+    const K *lo = begin > 0 ? bounds[begin] : nullptr;
+    const K *hi = end < bounds.size() ? bounds[end] : nullptr;
+    combineRange(a, b, op, lo, hi, parts[begin]);
+  });
+
+  std::vector<SourceEntry> entries;
+
+  for (std::vector<SourceEntry> &part : parts) {
+    entries.insert(entries.end(), part.begin(), part.end());
+  }
+
+  bulkBuild(entries.size(), threads,
+            [&entries](std::size_t i, K &key, [[maybe_unused]] V *value) {
+              key = *entries[i].first;
+
+              if constexpr (!keysOnly) {
+                std::construct_at(value, *entries[i].second);
+              }
+            });
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::sharesPools(
+    const BPlusTree &other) const {
+  if constexpr (!keysOnly) {
+    if (!(valueAllocator == other.valueAllocator))
+      return false;
+  }
+
+  return innerAllocator == other.innerAllocator &&
+         leafAllocator == other.leafAllocator;
+}
+
+/**
+ * Makes this tree draw from the pools of other. Only for empty trees without
+ * node handles, whose old pools hold nothing of theirs.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::takePools(
+    const BPlusTree &other) {
+  assert(!root && detached == 0);
+
+  if constexpr (!keysOnly) {
+    assignAllocator(valueAllocator, other.valueAllocator);
+  }
+
+  innerAllocator = other.innerAllocator;
+  leafAllocator = other.leafAllocator;
+  poolEpoch = other.poolEpoch;
+}
+
+/**
+ * Moves the nodes of owner, which come from the pools of from, into nodes of
+ * this tree's pools. Values are moved as well unless the value allocators
+ * compare equal. Linear in the size of owner.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::relocate(
+    BPlusTree &owner, BPlusTree &from) {
+  if (!owner.root)
+    return;
+
+  LeafNode *last = nullptr;
+  owner.root = relocate(from, owner.root, 1, owner.height, last);
+  owner.maxNode = owner.insertHint = last;
+
+  Node *node = owner.root;
+
+  for (unsigned depth = 1; depth < owner.height; depth++) {
+    node = asInner(node)->children[0];
+  }
+
+  owner.minNode = asLeaf(node);
+}
+
+// relocates the subtree of node, last is the leaf relocated before it
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Node *
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::relocate(BPlusTree &from,
+                                                        Node *node,
+                                                        unsigned depth,
+                                                        unsigned height,
+                                                        LeafNode *&last) {
+  if (depth >= height) {
+    LeafNode *leaf = asLeaf(node);
+    LeafNode *copy =
+        std::construct_at(leafAllocator.allocate(1), std::move(*leaf));
+
+    if constexpr (!keysOnly) {
+      if (!(valueAllocator == from.valueAllocator)) {
+        for (std::size_t i = 0; i < copy->size; i++) {
+          V *value = copy->values[i];
+          copy->values[i] = makeValue(std::move(*value));
+          std::destroy_at(value);
+          from.valueAllocator.deallocate(value, 1);
+        }
+      }
+    }
+
+    copy->prev = last;
+    copy->next = nullptr;
+
+    if (last) {
+      last->next = copy;
+    }
+
+    last = copy;
+    from.freeNode(leaf, true);
+    return copy;
+  }
+
+  InnerNode *inner = asInner(node);
+  InnerNode *copy =
+      std::construct_at(innerAllocator.allocate(1), std::move(*inner));
+
+  for (std::size_t i = 0; i <= copy->size; i++) {
+    copy->children[i] =
+        relocate(from, copy->children[i], depth + 1, height, last);
+  }
+
+  from.freeNode(inner, false);
+  return copy;
+}
+
+/**
+ * Refreshes the child slots along the rightmost path if last is set, else
+ * along the leftmost one, bottom up.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::refreshSpine(bool last) {
+  if constexpr (augmented) {
+    std::vector<InnerNode *> spine;
+
+    for (Node *node = root; spine.size() + 1 < height;) {
+      InnerNode *inner = asInner(node);
+      spine.push_back(inner);
+      node = inner->children[last ? inner->size : 0];
+    }
+
+    for (std::size_t level = spine.size(); level > 0; level--) {
+      InnerNode *inner = spine[level - 1];
+      refreshChild(inner, last ? inner->size : 0, level == spine.size());
+    }
+  }
+}
+
+/**
+ * Restores the fill of the inner nodes along the rightmost path if last is
+ * set, else along the leftmost one, after split_at or join left them with any
+ * number of keys. Leaves on the path may stay underfull. Fixing a node can
+ * merge it into its sibling and leave the parent short of a key, in which
+ * case the path is walked again from the root.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::repairSpine(bool last) {
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  for (bool repaired = false; !repaired;) {
+    while (height > 1 && root->size == 0) {
+      shrinkRoot();
+    }
+
+    if (height <= 2)
+      return;
+
+    repaired = true;
+    InnerNode *parent = asInner(root);
+
+    for (unsigned depth = 1; repaired && depth + 1 < height;) {
+      std::size_t idx = last ? parent->size : 0;
+      Node *child = parent->children[idx];
+
+      if (child->size >= MIN_KEYS) {
+        parent = asInner(child);
+        depth++;
+        continue;
+      }
+
+      rebalance(parent, idx, false);
+      repaired = parent == root ? root->size > 0 : parent->size >= MIN_KEYS;
+    }
+  }
+}
+
+/**
+ * Moves all keys not less than key into right, which must be empty. Every node
+ * on the path to key is cut in two, so no keys or values are copied and both
+ * trees only need repairs along the cut. Right takes over the pools of this
+ * tree, which keep holding the moved nodes. Only if right has node handles
+ * out, whose values its own pools hold, are the moved nodes copied into those
+ * pools instead, which takes time linear in their number. The sizes of both
+ * parts are known without visiting every leaf: OrderStatistics reads them off
+ * the subtree counts, otherwise the leaves of the smaller part are counted.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::split_at(
+    const K &key, BPlusTree &right) {
+  assert(this != &right);
+
+  if (right.root)
+    throw std::invalid_argument("split target must be empty");
+
+  if (!root || maxNode->keys[maxNode->size - 1] < key)
+    return;
+
+  if (!(minNode->keys[0] < key)) {
+    right.join(*this);
+    return;
+  }
+
+  version++;
+  right.version++;
+
+  bool shared = right.sharesPools(*this);
+
+  if (!shared && right.detached == 0) {
+    right.takePools(*this);
+    shared = true;
+  }
+
+  // cut every node on the path, the original keeps the left part
+  std::vector<std::pair<InnerNode *, InnerNode *>> cuts;
+  Node *node = root;
+
+  for (unsigned depth = 1; depth < height; depth++) {
+    InnerNode *inner = asInner(node);
+    std::size_t idx;
+    findKeyInNode(inner, key, idx);
+
+    InnerNode *other = std::construct_at(innerAllocator.allocate(1));
+    other->size = inner->size - idx;
+
+    for (std::size_t j = 0; j < other->size; j++) {
+      other->keys[j] = std::move(inner->keys[idx + j]);
+      moveChild(other, j + 1, inner, idx + j + 1);
+    }
+
+    inner->size = idx;
+    cuts.push_back({inner, other});
+    node = inner->children[idx];
+  }
+
+  LeafNode *leaf = asLeaf(node);
+  std::size_t idx;
+
+  if (findKeyInNode(leaf, key, idx)) {
+    idx--;
+  }
+
+  LeafNode *rightLeaf = std::construct_at(leafAllocator.allocate(1));
+  rightLeaf->size = leaf->size - idx;
+
+  for (std::size_t j = 0; j < rightLeaf->size; j++) {
+    rightLeaf->keys[j] = std::move(leaf->keys[idx + j]);
+    moveValue(rightLeaf, j, leaf, idx + j);
+  }
+
+  leaf->size = idx;
+  rightLeaf->next = leaf->next;
+  leaf->next = nullptr;
+
+  if (rightLeaf->next) {
+    rightLeaf->next->prev = rightLeaf;
+  }
+
+  right.maxNode = maxNode == leaf ? rightLeaf : maxNode;
+  right.minNode = rightLeaf;
+  maxNode = leaf;
+
+  // drop a half that ended up empty, and with it every ancestor of it that
+  // has no other child left
+  Node *leftChild = leaf;
+  Node *rightChild = rightLeaf;
+
+  if (leaf->size == 0) {
+    maxNode = leaf->prev;
+    maxNode->next = nullptr;
+    freeNode(leaf, true);
+    leftChild = nullptr;
+  }
+
+  if (rightLeaf->size == 0) {
+    right.minNode = rightLeaf->next;
+    right.minNode->prev = nullptr;
+    freeNode(rightLeaf, true);
+    rightChild = nullptr;
+  }
+
+  for (std::size_t level = cuts.size(); level > 0; level--) {
+    auto [inner, other] = cuts[level - 1];
+    bool childIsLeaf = level == cuts.size();
+
+    if (leftChild) {
+      refreshChild(inner, inner->size, childIsLeaf);
+      leftChild = inner;
+    } else if (inner->size > 0) {
+      inner->size--;
+      leftChild = inner;
+    } else {
+      freeNode(inner, false);
+    }
+
+    if (rightChild) {
+      other->children[0] = rightChild;
+      refreshChild(other, 0, childIsLeaf);
+      rightChild = other;
+    } else if (other->size > 0) {
+      removeInnerKey(other, 0);
+      rightChild = other;
+    } else {
+      freeNode(other, false);
+    }
+  }
+
+  root = leftChild;
+  right.root = rightChild;
+  right.height = height;
+
+  // the children of right's root carry its count, otherwise the leaves of
+  // the smaller part are counted walking away from the cut
+  std::size_t moved = 0;
+
+  if constexpr (Ranked) {
+    if (right.height > 1) {
+      for (std::size_t i = 0; i <= right.root->size; i++) {
+        moved += asInner(right.root)->counts[i];
+      }
+    } else {
+      moved = right.minNode->size;
+    }
+  } else {
+    const LeafNode *down = maxNode;
+    const LeafNode *up = right.minNode;
+    std::size_t kept = 0;
+
+    for (; down && up; down = down->prev, up = up->next) {
+      kept += down->size;
+      moved += up->size;
+    }
+
+    if (up) {
+      moved = keyCount - kept;
+    }
+  }
+
+  right.keyCount = moved;
+  keyCount -= moved;
+
+  if (!shared) {
+    right.relocate(right, *this);
+  }
+
+  repairSpine(true);
+  right.repairSpine(false);
+  insertHint = maxNode;
+  right.insertHint = right.maxNode;
+}
+
+/**
+ * Moves the contents of other, whose keys must all be greater or all be less
+ * than those of this tree, into this tree and leaves other empty. The root of
+ * the lower tree is hung into the spine of the higher one at the matching
+ * level, so no keys or values are copied and only that spine needs repairs.
+ * That takes both trees to draw from the same pools, as after split_at or on
+ * one Arena. An empty tree takes over the pools of other, otherwise the nodes
+ * of other are first copied into this tree's pools.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::join(BPlusTree &other) {
+  assert(this != &other);
+
+  if (!other.root)
+    return;
+
+  bool prepend = root && other.maxNode->keys[other.maxNode->size - 1] <
+                             minNode->keys[0];
+
+  if (root && !prepend &&
+      !(maxNode->keys[maxNode->size - 1] < other.minNode->keys[0]))
+    throw std::invalid_argument("joined trees overlap");
+
+  version++;
+  other.version++;
+
+  if (!sharesPools(other)) {
+    if (!root && detached == 0) {
+      takePools(other);
+    } else {
+      relocate(other, other);
+    }
+  }
+
+  // with shared pools the nodes can trade places, so that other comes last
+  if (prepend) {
+    std::swap(root, other.root);
+    std::swap(height, other.height);
+    std::swap(minNode, other.minNode);
+    std::swap(maxNode, other.maxNode);
+  }
+
+  if (!root) {
+    root = other.root;
+    height = other.height;
+    minNode = other.minNode;
+
+  } else {
+    // the smallest key of other separates the two trees
+    K separator = other.minNode->keys[0];
+    maxNode->next = other.minNode;
+    other.minNode->prev = maxNode;
+
+    if (height == other.height) {
+      InnerNode *newRoot = std::construct_at(innerAllocator.allocate(1), root);
+      insertInner(newRoot, 0, std::move(separator), other.root);
+      refreshChild(newRoot, 0, height == 1);
+      refreshChild(newRoot, 1, height == 1);
+      root = newRoot;
+      height++;
+
+      // both former roots may be underfull
+      repairSpine(true);
+      repairSpine(false);
+
+    } else {
+      bool last = height > other.height;
+      Node *graft = last ? other.root : root;
+      unsigned graftHeight = last ? other.height : height;
+
+      if (!last) {
+        root = other.root;
+        height = other.height;
+      }
+
+      // walk the spine down to the node whose children have the graft's height
+      std::vector<InnerNode *> spine{asInner(root)};
+
+      while (spine.size() + graftHeight < height) {
+        InnerNode *inner = spine.back();
+        spine.push_back(asInner(inner->children[last ? inner->size : 0]));
+      }
+
+      InnerNode *parent = spine.back();
+
+      if (last) {
+        insertInner(parent, parent->size, std::move(separator), graft);
+        refreshChild(parent, parent->size, graftHeight == 1);
+      } else {
+        insertInner(parent, 0, std::move(separator), parent->children[0]);
+        moveChild(parent, 1, parent, 0);
+        parent->children[0] = graft;
+        refreshChild(parent, 0, graftHeight == 1);
+      }
+
+      // split overflowing nodes bottom up
+      for (std::size_t level = spine.size() - 1; level > 0; level--) {
+        InnerNode *inner = spine[level - 1];
+
+        if (spine[level]->size > N) {
+          split(inner, last ? inner->size : 0, false, false);
+        }
+      }
+
+      if (root->size > N) {
+        splitRoot(false);
+      }
+
+      refreshSpine(last);
+      repairSpine(last);
+    }
+  }
+
+  maxNode = insertHint = other.maxNode;
+  keyCount += other.keyCount;
+
+  other.root = nullptr;
+  other.minNode = nullptr;
+  other.maxNode = nullptr;
+  other.insertHint = nullptr;
+  other.height = 0;
+  other.keyCount = 0;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::erase(unsigned depth,
+                                                          Node *node,
+                                                          const K &key,
+                                                          V **released) {
+
+  // find key in current node
+  std::size_t idx;
+  bool isLeaf = depth >= height;
+  bool childIsLeaf = depth + 1 >= height;
+  bool found = findKeyInNode(node, key, idx);
+
+  if (isLeaf) {
+    if (found) {
+      // remove from leaf
+      LeafNode *leaf = asLeaf(node);
+
+      if constexpr (!keysOnly) {
+        if (released) {
+          *released = leaf->values[idx - 1];
+        } else {
+          std::destroy_at(leaf->values[idx - 1]);
+          valueAllocator.deallocate(leaf->values[idx - 1], 1);
+        }
+      }
+
+      removeKeyFromLeaf(leaf, idx - 1);
+      return true;
+
+    } else {
+      // nothing to do
+      return false;
+    }
+  }
+
+  InnerNode *inner = asInner(node);
+  bool retval;
+  Node *child;
+
+  if (found) {
+    // find next smallest and largest
+    // swap smaller with current key and replace larger
+    idx--;
+    child = inner->children[idx];
+
+    unsigned currentDepth = depth + 1;
+    Node *smallest = child;
+    Node *largest = inner->children[idx + 1];
+
+    while (currentDepth < height) {
+      smallest = asInner(smallest)->children[smallest->size];
+      largest = asInner(largest)->children[0];
+      currentDepth++;
+    }
+
+    LeafNode *nextSmallest = asLeaf(smallest);
+    LeafNode *nextLargest = asLeaf(largest);
+
+    assert(nextLargest->keys[0] == key &&
+           "Inner node must have duplicate key as direct successor");
+
+    const K &nextSmallestKey = nextSmallest->keys[nextSmallest->size - 1];
+
+    // duplicate key of nextSmallest as inner node
+    nextLargest->keys[0] = nextSmallestKey;
+    inner->keys[idx] = nextSmallestKey;
+
+    // swap value nodes
+    if constexpr (!keysOnly) {
+      std::swap(nextSmallest->values[nextSmallest->size - 1],
+                nextLargest->values[0]);
+    }
+
+    if constexpr (aggregated) {
+      // the right subtree now holds a different value on its leftmost path
+      if (!childIsLeaf) {
+        refreshLeftSpine(asInner(inner->children[idx + 1]), depth + 1);
+      }
+
+      refreshChild(inner, idx + 1, childIsLeaf);
+    }
+
+    erase(depth + 1, child, nextSmallestKey, released);
+    retval = true;
+
+  } else {
+    child = inner->children[idx];
+    prefetchKeys(child);
+    retval = erase(depth + 1, child, key, released);
+  }
+
+  // a miss changes nothing, not even a child left underfull by split_at
+  if (!retval)
+    return false;
+
+  // rebalance tree
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  if (child->size < (childIsLeaf ? leafMinimum : MIN_KEYS)) {
+    rebalance(inner, idx, childIsLeaf);
+  } else {
+    refreshChild(inner, idx, childIsLeaf);
+  }
+
+  return retval;
+}
+
+/**
+ * Restores the minimum fill of the child at idx by moving keys over from a
+ * sibling or merging with it. Leaves are filled up in one go, inner children
+ * gain one key per call unless they are merged.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::rebalance(
+    InnerNode *node, std::size_t idx, bool childIsLeaf) {
+  constexpr std::size_t MIN_KEYS = N / 2;
+
+  Node *child = node->children[idx];
+  assert(child->size < MIN_KEYS);
+
+  Node *leftSibling = idx > 0 ? node->children[idx - 1] : nullptr;
+  Node *rightSibling = idx < node->size ? node->children[idx + 1] : nullptr;
+
+  // try steal from left sibling
+  if (leftSibling && leftSibling->size + child->size >= 2 * MIN_KEYS) {
+
+    if (childIsLeaf) {
+      LeafNode *leaf = asLeaf(child);
+      LeafNode *left = asLeaf(leftSibling);
+
+      // move keys over so that both leaves end up half full
+      std::size_t count = (left->size + leaf->size) / 2 - leaf->size;
+
+      for (std::size_t j = leaf->size; j > 0; j--) {
+        leaf->keys[j - 1 + count] = std::move(leaf->keys[j - 1]);
+        moveValue(leaf, j - 1 + count, leaf, j - 1);
+      }
+
+      std::size_t from = left->size - count;
+      for (std::size_t j = 0; j < count; j++) {
+        leaf->keys[j] = std::move(left->keys[from + j]);
+        moveValue(leaf, j, left, from + j);
+      }
+
+      leaf->size += count;
+      left->size = from;
+      node->keys[idx - 1] = leaf->keys[0];
+
+    } else {
+      // rotate keys
+      InnerNode *inner = asInner(child);
+      InnerNode *left = asInner(leftSibling);
+
+      insertInner(inner, 0, std::move(node->keys[idx - 1]), inner->children[0]);
+      moveChild(inner, 1, inner, 0);
+      moveChild(inner, 0, left, left->size);
+      node->keys[idx - 1] = std::move(left->keys[left->size - 1]);
+      left->size--;
+    }
+
+    refreshChild(node, idx - 1, childIsLeaf);
+    refreshChild(node, idx, childIsLeaf);
+    return;
+  }
+
+  // try steal from right sibling
+  if (rightSibling && rightSibling->size + child->size >= 2 * MIN_KEYS) {
+
+    if (childIsLeaf) {
+      LeafNode *leaf = asLeaf(child);
+      LeafNode *right = asLeaf(rightSibling);
+      assert(right->keys[0] == node->keys[idx]);
+
+      // move keys over so that both leaves end up half full
+      std::size_t count = (right->size + leaf->size) / 2 - leaf->size;
+
+      for (std::size_t j = 0; j < count; j++) {
+        leaf->keys[leaf->size + j] = std::move(right->keys[j]);
+        moveValue(leaf, leaf->size + j, right, j);
+      }
+
+      for (std::size_t j = count; j < right->size; j++) {
+        right->keys[j - count] = std::move(right->keys[j]);
+        moveValue(right, j - count, right, j);
+      }
+
+      leaf->size += count;
+      right->size -= count;
+      node->keys[idx] = right->keys[0];
+
+      // an emptied child has a new first key
+      if (idx > 0) {
+        node->keys[idx - 1] = leaf->keys[0];
+      }
+
+    } else {
+      // rotate keys
+      InnerNode *inner = asInner(child);
+      InnerNode *right = asInner(rightSibling);
+
+      std::size_t end = inner->size;
+      insertInner(inner, end, std::move(node->keys[idx]), right->children[0]);
+      moveChild(inner, end + 1, right, 0);
+
+      node->keys[idx] = right->keys[0];
+      removeInnerKey(right, 0);
+    }
+
+    refreshChild(node, idx, childIsLeaf);
+    refreshChild(node, idx + 1, childIsLeaf);
+    return;
+  }
+
+  if constexpr (instrumented) {
+    stats.merges++;
+  }
+
+  // merge with left
+  if (leftSibling) {
+
+    if (childIsLeaf) {
+      LeafNode *leaf = asLeaf(child);
+      LeafNode *left = asLeaf(leftSibling);
+
+      for (std::size_t i = 0; i < leaf->size; i++) {
+        left->keys[left->size + i] = std::move(leaf->keys[i]);
+        moveValue(left, left->size + i, leaf, i);
+      }
+
+      left->size += leaf->size;
+      left->next = leaf->next;
+
+      if (insertHint == leaf) {
+        insertHint = left;
+      }
+
+      if (leaf->next) {
+        leaf->next->prev = left;
+      } else {
+        assert(leaf == maxNode);
+        maxNode = left;
+      }
+
+    } else {
+      InnerNode *inner = asInner(child);
+      InnerNode *left = asInner(leftSibling);
+      std::size_t end = left->size;
+
+      left->keys[end] = std::move(node->keys[idx - 1]);
+      moveChild(left, end + 1, inner, 0);
+
+      for (std::size_t i = 0; i < inner->size; i++) {
+        left->keys[end + i + 1] = std::move(inner->keys[i]);
+        moveChild(left, end + i + 2, inner, i + 1);
+      }
+
+      left->size += inner->size + 1;
+    }
+
+    freeNode(child, childIsLeaf);
+
+    removeInnerKey(node, idx - 1); // remove child
+    node->children[idx - 1] = leftSibling;
+    refreshChild(node, idx - 1, childIsLeaf);
+
+  } else {
+    // merge right
+    assert(rightSibling);
+
+    if (childIsLeaf) {
+      LeafNode *leaf = asLeaf(child);
+      LeafNode *right = asLeaf(rightSibling);
+
+      for (std::size_t i = 0; i < right->size; i++) {
+        leaf->keys[leaf->size + i] = std::move(right->keys[i]);
+        moveValue(leaf, leaf->size + i, right, i);
+      }
+
+      leaf->size += right->size;
+      leaf->next = right->next;
+
+      if (insertHint == right) {
+        insertHint = leaf;
+      }
+
+      if (right->next) {
+        right->next->prev = leaf;
+      } else {
+        assert(right == maxNode);
+        maxNode = leaf;
+      }
+
+    } else {
+      InnerNode *inner = asInner(child);
+      InnerNode *right = asInner(rightSibling);
+      std::size_t end = inner->size;
+
+      inner->keys[end] = std::move(node->keys[idx]);
+      moveChild(inner, end + 1, right, 0);
+
+      for (std::size_t i = 0; i < right->size; i++) {
+        inner->keys[end + i + 1] = std::move(right->keys[i]);
+        moveChild(inner, end + i + 2, right, i + 1);
+      }
+
+      inner->size += right->size + 1;
+    }
+
+    freeNode(rightSibling, childIsLeaf);
+
+    // remove right sibling by shifting nodes
+    removeInnerKey(node, idx);
+    node->children[0] = child;
+    refreshChild(node, 0, childIsLeaf);
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::freeValues() {
+  // pools that can be reset as a whole don't need every value handed back
+  constexpr bool pooled = !keysOnly && requires(Alloc &alloc) {
+    alloc.reset();
+    alloc.exclusive();
+  };
+
+  if constexpr (keysOnly) {
+    return;
+  } else {
+    // a reset would hand out the slots of node handles and other trees again
+    bool reset = pooled && detached == 0;
+
+    if constexpr (pooled) {
+      reset = reset && valueAllocator.exclusive();
+    }
+
+    if (!std::is_trivially_destructible_v<V> || !reset) {
+      for (LeafNode *node = minNode; node; node = node->next) {
+        for (std::size_t i = 0; i < node->size; i++) {
+          std::destroy_at(node->values[i]);
+
+          if (!reset) {
+            valueAllocator.deallocate(node->values[i], 1);
+          }
+        }
+      }
+    }
+
+    if constexpr (pooled) {
+      if (reset) {
+        valueAllocator.reset();
+      }
+    }
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::clear() {
+  if (poolEpoch == leafAllocator.epoch()) {
+    freeValues();
+    freeNodes();
+  } else {
+    // the arena has released everything already
+    poolEpoch = leafAllocator.epoch();
+    detached = 0;
+  }
+
+  keyCount = 0;
+  height = 0;
+  root = nullptr;
+  minNode = nullptr;
+  maxNode = nullptr;
+  insertHint = nullptr;
+  version++;
+
+  if constexpr (radixKeys) {
+    if (directory) {
+      directory->build(nullptr, version);
+    }
+  }
+}
+
+/**
+ * Returns all nodes to their pools. Pools that no other tree draws from are
+ * reset as a whole instead.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::freeNodes() {
+  if (innerAllocator.exclusive() && leafAllocator.exclusive()) {
+    innerAllocator.reset();
+    leafAllocator.reset();
+  } else if (root) {
+    freeSubtree(root, 1);
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::freeSubtree(
+    Node *node, unsigned depth) {
+  bool isLeaf = depth >= height;
+
+  if (!isLeaf) {
+    for (std::size_t i = 0; i <= node->size; i++) {
+      freeSubtree(asInner(node)->children[i], depth + 1);
+    }
+  }
+
+  freeNode(node, isLeaf);
+}
+
+/**
+ * Moves the leaf frame to the adjacent leaf under the same parent if key lies
+ * beyond the current leaf. This covers the common next/prev case without
+ * searching the parent.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Cursor::stepSibling(
+    const K &key) {
+  if (path.size() < 2)
+    return false;
+
+  const Frame &parent = path[path.size() - 2];
+  Frame &leaf = path.back();
+  InnerNode *node = asInner(parent.node);
+
+  if (leaf.hi && !(key < *leaf.hi) && leaf.idx < node->size) {
+    std::size_t i = leaf.idx + 1;
+    leaf = {node->children[i], i, &node->keys[i - 1],
+            i < node->size ? &node->keys[i] : parent.hi};
+
+  } else if (leaf.lo && key < *leaf.lo && leaf.idx > 0) {
+    std::size_t i = leaf.idx - 1;
+    leaf = {node->children[i], i, i > 0 ? &node->keys[i - 1] : parent.lo,
+            &node->keys[i]};
+
+  } else {
+    return false;
+  }
+
+  return covers(leaf, key);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Cursor::descend(
+    std::size_t level, const K &key) {
+  path.resize(level + 1);
+
+  while (path.size() < tree->height) {
+    const Frame &frame = path.back();
+    InnerNode *node = asInner(frame.node);
+
+    std::size_t idx;
+    tree->findKeyInNode(node, key, idx);
+    tree->prefetchKeys(node->children[idx]);
+
+    K *lo = idx > 0 ? &node->keys[idx - 1] : frame.lo;
+    K *hi = idx < node->size ? &node->keys[idx] : frame.hi;
+    path.push_back({node->children[idx], idx, lo, hi});
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::LeafNode *
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Cursor::seekLeaf(const K &key) {
+  if constexpr (instrumented) {
+    tree->stats.lookups++;
+  }
+
+  if (!tree->root) {
+    path.clear();
+    return nullptr;
+  }
+
+  if (path.empty() || version != tree->version) {
+    // tree has changed, restart at root
+    path.assign(1, {tree->root, 0, nullptr, nullptr});
+    version = tree->version;
+    descend(0, key);
+    return asLeaf(path.back().node);
+  }
+
+  if (covers(path.back(), key) || stepSibling(key))
+    return asLeaf(path.back().node);
+
+  // climb until the subtree contains key
+  std::size_t level = path.size() - 1;
+  while (level > 0 && !covers(path[level], key)) {
+    level--;
+  }
+
+  descend(level, key);
+  return asLeaf(path.back().node);
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::iterator
+BPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::Cursor::seek(const K &key) {
+  LeafNode *leaf = seekLeaf(key);
+
+  std::size_t idx;
+  if (!leaf || !tree->findKeyInNode(leaf, key, idx))
+    return tree->end();
+
+  return iterator(leaf, idx - 1, true, tree->prefetchDistance);
+}
+
+/**
+ * Ordered set of keys. Leaves store nothing but keys, so a leaf takes about
+ * half the memory of a map leaf with the same fanout and no value pool exists.
+ * Batches passed to insert_batch hold plain keys.
+ */
+template <typename Key, std::size_t N, bool OrderStatistics = false,
+          typename Stats = NoStats>
+using BPlusTreeSet =
+    BPlusTree<Key, NoValue, N, SegmentedFreelistAllocator<NoValue>,
+              OrderStatistics, NoAggregate, Stats>;
+
+/**
+ * Bytes taken by the larger of the inner node and leaf layouts of a BPlusTree
+ * with fanout n and no order statistics or aggregates, padding included.
+ */
+template <typename Key, typename Value>
+constexpr std::size_t bplustreeNodeBytes(std::size_t n) {
+  auto roundUp = [](std::size_t bytes, std::size_t alignment) {
+    return (bytes + alignment - 1) / alignment * alignment;
+  };
+
+  constexpr std::size_t pointer = sizeof(void *);
+  constexpr std::size_t alignment =
+      std::max({alignof(std::size_t), alignof(Key), alignof(void *)});
+
+  // members of the derived nodes may start in the tail padding of Node
+  std::size_t keysEnd = roundUp(sizeof(std::size_t), alignof(Key)) +
+                        (n + 1) * sizeof(Key);
+  std::size_t base = roundUp(keysEnd, alignof(void *));
+
+  std::size_t inner = base + (n + 2) * pointer;
+  std::size_t leaf = base + 2 * pointer;
+
+  if constexpr (!std::is_same_v<Value, NoValue>) {
+    leaf += (n + 1) * pointer;
+  }
+
+  return roundUp(std::max(inner, leaf), alignment);
+}
+
+/**
+ * Largest fanout whose inner nodes and leaves both fit in TargetBytes, which
+ * must be a whole number of cache lines, e.g. 256 or a 4096 byte page.
+ */
+template <typename Key, typename Value, std::size_t TargetBytes>
+constexpr std::size_t bplustreeFanout() {
+  static_assert(TargetBytes % CACHE_LINE_SIZE == 0,
+                "target must be a multiple of the cache line size");
+  static_assert(bplustreeNodeBytes<Key, Value>(4) <= TargetBytes,
+                "target is too small for the smallest fanout");
+
+  std::size_t n = 4;
+
+  while (bplustreeNodeBytes<Key, Value>(n + 1) <= TargetBytes) {
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * BPlusTree whose fanout is derived from the sizes of its keys and pointers so
+ * that nodes fill TargetBytes as closely as possible.
+ */
+template <typename Key, typename Value, std::size_t TargetBytes = 4096,
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>>
+using BPlusTreeFor =
+    BPlusTree<Key, Value, bplustreeFanout<Key, Value, TargetBytes>(),
+              ValueAllocator>;
+
+/**
+ * Ordered multimap built on BPlusTree. Every entry is stored under its key
+ * paired with an insertion number, so the values of a key occupy adjacent leaf
+ * slots in insertion order and splits, merges and batch operations need no
+ * special handling. The template parameters are those of BPlusTree.
+ */
+template <typename Key, typename Value, std::size_t N,
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>,
+          bool OrderStatistics = false, typename Aggregate = NoAggregate,
+          typename Stats = NoStats>
+class BPlusTreeMultimap {
+public:
+  using key_type = Key;
+  using value_type = Value;
+
+private:
+  using Tree = BPlusTree<std::pair<Key, std::size_t>, Value, N, ValueAllocator,
+                         OrderStatistics, Aggregate, Stats>;
+
+  Tree tree;
+  std::size_t sequence = 0; // insertion number of the next entry
+
+  // bounds of the stored keys of key, the upper one is never handed out
+  static typename Tree::key_type first(const key_type &key) {
+    return {key, 0};
+  }
+
+  static typename Tree::key_type last(const key_type &key) {
+    return {key, std::numeric_limits<std::size_t>::max()};
+  }
+
+public:
+  using iterator = typename Tree::iterator;
+  using const_iterator = typename Tree::const_iterator;
+
+  std::size_t size() const { return tree.size(); }
+
+  bool empty() const { return tree.size() == 0; }
+
+  // adds an entry after all existing entries of key
+  template <typename... Args>
+  void emplace(const key_type &key, Args &&...args) {
+    tree.emplace({key, sequence++}, std::forward<Args>(args)...);
+  }
+
+  template <typename ValueFwd>
+  void insert(const key_type &key, ValueFwd &&value) {
+    emplace(key, std::forward<ValueFwd>(value));
+  }
+
+  void insert(const std::pair<key_type, value_type> &entry) {
+    emplace(entry.first, entry.second);
+  }
+
+  // erases all entries of key and returns how many there were
+  std::size_t erase(const key_type &key) {
+    return tree.erase_range(first(key), last(key));
+  }
+
+  void clear() {
+    tree.clear();
+    sequence = 0;
+  }
+
+  // iterates the values of key in insertion order
+  std::pair<iterator, iterator> equal_range(const key_type &key) {
+    return {tree.lower_bound(first(key)), tree.lower_bound(last(key))};
+  }
+
+  std::pair<const_iterator, const_iterator>
+  equal_range(const key_type &key) const {
+    return {tree.lower_bound(first(key)), tree.lower_bound(last(key))};
+  }
+
+  std::size_t count(const key_type &key) const {
+    auto [it, end] = equal_range(key);
+    std::size_t n = 0;
+
+    for (; it != end; ++it) {
+      n++;
+    }
+
+    return n;
+  }
+
+  bool contains(const key_type &key) const {
+    auto [it, end] = equal_range(key);
+    return it != end;
+  }
+
+  iterator begin() noexcept { return tree.begin(); }
+
+  iterator end() noexcept { return tree.end(); }
+
+  const_iterator begin() const noexcept { return tree.cbegin(); }
+
+  const_iterator end() const noexcept { return tree.cend(); }
+
+  const_iterator cbegin() const noexcept { return tree.cbegin(); }
+
+  const_iterator cend() const noexcept { return tree.cend(); }
+};
+
+/**
+ * Write-optimized front end for BPlusTree in the spirit of a B-epsilon tree.
+ * Inserts and erases go into a message buffer, itself a BPlusTree that keeps
+ * only the newest message per key. Once BufferSize keys have pending
+ * messages, they are applied in key order through insert_batch and
+ * erase_batch, so each leaf of the large tree is walked and dirtied once per
+ * flush instead of once per message. Lookups consult the buffer before the
+ * tree. Erases are blind and don't report whether the key existed. flushed()
+ * applies all pending messages and exposes the underlying BPlusTree for
+ * iteration and range queries.
+ *
+ * The buffer is not meant to fit in cache: at the default BufferSize it holds
+ * a few MB even for small keys and values, since every message stores its key
+ * twice besides the value. Large flushes are what let each leaf be touched
+ * once; a BufferSize of a few thousand keeps the buffer within L2 at the cost
+ * of more frequent, less effective flushes.
+ */
+template <typename Key, typename Value, std::size_t N,
+          std::size_t BufferSize = 65536,
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>,
+          bool OrderStatistics = false, typename Aggregate = NoAggregate,
+          typename Stats = NoStats>
+class BufferedBPlusTree {
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using Tree = BPlusTree<Key, Value, N, ValueAllocator, OrderStatistics,
+                         Aggregate, Stats>;
+  using iterator = typename Tree::iterator;
+
+  static_assert(BufferSize > 0, "buffer must hold at least one message");
+
+private:
+  // a message without value erases its key, the key is repeated so that
+  // flushes can read it while iterating the buffer
+  using Message = std::pair<Key, std::optional<Value>>;
+
+  Tree tree;
+  BPlusTree<Key, Message, N> buffer;
+
+  void push(const key_type &key, Message &&message) {
+    buffer.emplace(key, std::move(message));
+
+    if (buffer.size() >= BufferSize) {
+      flush();
+    }
+  }
+
+public:
+  template <typename... Args>
+  void emplace(const key_type &key, Args &&...args) {
+    push(key, {key, std::optional<Value>(std::in_place,
+                                         std::forward<Args>(args)...)});
+  }
+
+  template <typename ValueFwd>
+  void insert(const key_type &key, ValueFwd &&value) {
+    emplace(key, std::forward<ValueFwd>(value));
+  }
+
+  void insert(const std::pair<key_type, value_type> &entry) {
+    emplace(entry.first, entry.second);
+  }
+
+  void erase(const key_type &key) { push(key, {key, std::nullopt}); }
+
+  void flush();
+
+  std::size_t pending() const noexcept { return buffer.size(); }
+
+  bool contains(const key_type &key) const;
+
+  const value_type &at(const key_type &key) const;
+
+  std::size_t size() {
+    flush();
+    return tree.size();
+  }
+
+  bool empty() { return size() == 0; }
+
+  void clear() {
+    buffer.clear();
+    tree.clear();
+  }
+
+  Tree &flushed() {
+    flush();
+    return tree;
+  }
+
+  iterator begin() { return flushed().begin(); }
+
+  iterator end() { return flushed().end(); }
+};
+
+template <typename K, typename V, std::size_t N, std::size_t B, typename Alloc,
+          bool Ranked, typename Agg, typename Stats>
+void BufferedBPlusTree<K, V, N, B, Alloc, Ranked, Agg, Stats>::flush() {
+  if (buffer.size() == 0)
+    return;
+
+  std::vector<std::pair<K, V>> inserts;
+  std::vector<K> erases;
+
+  for (Message &message : buffer) {
+    if (message.second) {
+      inserts.emplace_back(std::move(message.first),
+                           std::move(*message.second));
+    } else {
+      erases.push_back(std::move(message.first));
+    }
+  }
+
+  buffer.clear();
+  tree.erase_batch(erases.begin(), erases.end());
+  tree.insert_batch(std::make_move_iterator(inserts.begin()),
+                    std::make_move_iterator(inserts.end()));
+}
+
+template <typename K, typename V, std::size_t N, std::size_t B, typename Alloc,
+          bool Ranked, typename Agg, typename Stats>
+bool BufferedBPlusTree<K, V, N, B, Alloc, Ranked, Agg, Stats>::contains(
+    const K &key) const {
+  auto it = buffer.find(key);
+
+  if (it != buffer.cend())
+    return it->second.has_value();
+
+  return tree.contains(key);
+}
+
+template <typename K, typename V, std::size_t N, std::size_t B, typename Alloc,
+          bool Ranked, typename Agg, typename Stats>
+const V &BufferedBPlusTree<K, V, N, B, Alloc, Ranked, Agg, Stats>::at(
+    const K &key) const {
+  auto it = buffer.find(key);
+
+  if (it == buffer.cend())
+    return tree.at(key);
+
+  if (!it->second)
+    throw std::out_of_range("key not found");
+
+  return *it->second;
+}
+
+/**
+ * Range-partitions the key space across Shards independent BPlusTrees, each
+ * with its own pools. Shard i holds the keys in [bounds[i - 1], bounds[i]), so
+ * ordered iteration visits the shards one after another. When an insert leaves
+ * a shard with more than 1.5 times the average number of keys, rebalance()
+ * moves the bounds to equal quantiles. Only the keys that change shards are
+ * touched: they are cut off with split_at and grafted onto the neighbour with
+ * join, which copies them into the neighbour's own pools.
+ *
+ * The front end itself is not thread safe. Threads that each own a shard can
+ * work on it concurrently through shard(shard_of(key)), with rebalance() run
+ * between such phases.
+ */
+template <typename Key, typename Value, std::size_t N, std::size_t Shards,
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>,
+          bool OrderStatistics = false, typename Aggregate = NoAggregate,
+          typename Stats = NoStats>
+class ShardedBPlusTree {
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using Tree = BPlusTree<Key, Value, N, ValueAllocator, OrderStatistics,
+                         Aggregate, Stats>;
+
+  static_assert(Shards > 0, "at least one shard is needed");
+  static_assert(!std::is_same_v<Value, NoValue>, "sets can't be sharded");
+
+private:
+  std::array<Tree, Shards> shards;
+  // ascending, shards past bounds.size() are empty and an empty shard before
+  // them repeats the bound of the next one
+  std::vector<Key> bounds;
+  // keys inserted and erased through the front end, resynced by rebalance()
+  std::size_t total = 0;
+
+  bool skewed(std::size_t shard) const {
+    return total >= Shards * N && 2 * Shards * shards[shard].size() > 3 * total;
+  }
+
+  key_type keyAt(std::size_t, std::size_t) const;
+
+  void absorb(std::size_t, Tree &);
+
+  void shift(std::size_t, std::size_t);
+
+  void resetBounds();
+
+public:
+  class ShardedIterator {
+  private:
+    friend class ShardedBPlusTree;
+
+    ShardedBPlusTree *owner;
+    std::size_t shard;
+    typename Tree::iterator it;
+
+    ShardedIterator(ShardedBPlusTree *owner, std::size_t shard,
+                    typename Tree::iterator it)
+        : owner(owner), shard(shard), it(it) {
+      skipExhausted();
+    }
+
+    void skipExhausted() {
+      while (shard < Shards && it == owner->shards[shard].end()) {
+        if (++shard < Shards) {
+          it = owner->shards[shard].begin();
+        }
+      }
+    }
+
+  public:
+    using value_type = Value;
+
+    value_type &operator*() const { return *it; }
+
+    value_type *operator->() { return &*it; }
+
+    const key_type &key() const { return it.key(); }
+
+    ShardedIterator &operator++() {
+      ++it;
+      skipExhausted();
+      return *this;
+    }
+
+    ShardedIterator operator++(int) {
+      ShardedIterator temp = *this;
+      ++(*this);
+      return temp;
+    }
+
+    bool operator==(const ShardedIterator &other) const {
+      return shard == other.shard && it == other.it;
+    }
+    bool operator!=(const ShardedIterator &other) const {
+      return !(*this == other);
+    }
+  };
+
+  using iterator = ShardedIterator;
+
+  std::size_t shard_of(const key_type &key) const {
+    return std::upper_bound(bounds.begin(), bounds.end(), key) -
+           bounds.begin();
+  }
+
+  Tree &shard(std::size_t i) { return shards[i]; }
+
+  const Tree &shard(std::size_t i) const { return shards[i]; }
+
+  std::size_t size() const {
+    std::size_t total = 0;
+
+    for (const Tree &tree : shards) {
+      total += tree.size();
+    }
+
+    return total;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  template <typename... Args>
+  void emplace(const key_type &key, Args &&...args) {
+    std::size_t i = shard_of(key);
+    std::size_t before = shards[i].size();
+    shards[i].emplace(key, std::forward<Args>(args)...);
+    total += shards[i].size() - before;
+
+    if (skewed(i)) {
+      rebalance();
+    }
+  }
+
+  template <typename ValueFwd>
+  void insert(const key_type &key, ValueFwd &&value) {
+    emplace(key, std::forward<ValueFwd>(value));
+  }
+
+  void insert(const std::pair<key_type, value_type> &entry) {
+    emplace(entry.first, entry.second);
+  }
+
+  bool erase(const key_type &key) {
+    if (!shards[shard_of(key)].erase(key))
+      return false;
+
+    total--;
+    return true;
+  }
+
+  void clear() {
+    for (Tree &tree : shards) {
+      tree.clear();
+    }
+
+    bounds.clear();
+    total = 0;
+  }
+
+  bool contains(const key_type &key) const {
+    return shards[shard_of(key)].contains(key);
+  }
+
+  value_type &at(const key_type &key) { return shards[shard_of(key)].at(key); }
+
+  const value_type &at(const key_type &key) const {
+    return shards[shard_of(key)].at(key);
+  }
+
+  iterator find(const key_type &key) {
+    std::size_t i = shard_of(key);
+    auto it = shards[i].find(key);
+    return it == shards[i].end() ? end() : iterator(this, i, it);
+  }
+
+  void rebalance();
+
+  iterator begin() { return iterator(this, 0, shards[0].begin()); }
+
+  iterator end() { return iterator(this, Shards, {}); }
+};
+
+/**
+ * Moves the shard bounds to equal quantiles of the current keys, so that
+ * shards 0 to b hold (b + 1) * size() / Shards keys. A first pass from the
+ * left pushes the excess of each shard on to its right neighbour, a second one
+ * from the right pulls what a shard still lacks from its right neighbour. Each
+ * step moves one boundary and only the keys between its old and new position.
+ */
+template <typename K, typename V, std::size_t N, std::size_t Shards,
+          typename Alloc, bool Ranked, typename Agg, typename Stats>
+void ShardedBPlusTree<K, V, N, Shards, Alloc, Ranked, Agg, Stats>::rebalance() {
+  total = size();
+  std::size_t prefix = 0; // keys in shards 0 to b
+
+  for (std::size_t b = 0; b + 1 < Shards; b++) {
+    std::size_t quota = (b + 1) * total / Shards;
+    prefix += shards[b].size();
+
+    if (prefix > quota) {
+      shift(b, shards[b].size() - (prefix - quota));
+      prefix = quota;
+    }
+  }
+
+  prefix = total;
+
+  for (std::size_t b = Shards - 1; b-- > 0;) {
+    std::size_t quota = (b + 1) * total / Shards;
+    prefix -= shards[b + 1].size();
+
+    if (prefix < quota) {
+      shift(b, shards[b].size() + (quota - prefix));
+      prefix = quota;
+    }
+  }
+
+  resetBounds();
+}
+
+/**
+ * Returns the key at position pos of shard i. Without OrderStatistics it is
+ * found walking from the nearer end of the shard, so finding a cut costs no
+ * more steps than there are keys on the far side of it.
+ */
+template <typename K, typename V, std::size_t N, std::size_t Shards,
+          typename Alloc, bool Ranked, typename Agg, typename Stats>
+K ShardedBPlusTree<K, V, N, Shards, Alloc, Ranked, Agg, Stats>::keyAt(
+    std::size_t i, std::size_t pos) const {
+  const Tree &tree = shards[i];
+
+  if constexpr (Ranked) {
+    return tree.select(pos).key();
+  } else if (2 * pos < tree.size()) {
+    auto it = tree.begin();
+
+    for (std::size_t j = 0; j < pos; j++) {
+      ++it;
+    }
+
+    return it.key();
+  } else {
+    auto it = tree.rbegin();
+
+    for (std::size_t j = tree.size() - 1; j > pos; j--) {
+      ++it;
+    }
+
+    return it.key();
+  }
+}
+
+/**
+ * Moves the entries of part, which lie beyond one end of shard i, into shard
+ * i. An empty shard would adopt the pools of part, which belong to another
+ * shard, so it gets the entries moved into its own pools instead.
+ */
+template <typename K, typename V, std::size_t N, std::size_t Shards,
+          typename Alloc, bool Ranked, typename Agg, typename Stats>
+void ShardedBPlusTree<K, V, N, Shards, Alloc, Ranked, Agg, Stats>::absorb(
+    std::size_t i, Tree &part) {
+  if (!shards[i].empty()) {
+    shards[i].join(part);
+    return;
+  }
+
+  std::vector<std::pair<K, V>> entries;
+  entries.reserve(part.size());
+
+  for (auto it = part.begin(); it != part.end(); ++it) {
+    entries.emplace_back(it.key(), std::move(*it));
+  }
+
+  part.clear();
+  shards[i].insert_batch(std::make_move_iterator(entries.begin()),
+                         std::make_move_iterator(entries.end()));
+}
+
+/**
+ * Moves the boundary between shards i and i + 1 so that shard i holds keep of
+ * their keys.
+ */
+template <typename K, typename V, std::size_t N, std::size_t Shards,
+          typename Alloc, bool Ranked, typename Agg, typename Stats>
+void ShardedBPlusTree<K, V, N, Shards, Alloc, Ranked, Agg, Stats>::shift(
+    std::size_t i, std::size_t keep) {
+  std::size_t size = shards[i].size();
+
+  if (keep < size) {
+    Tree moved;
+    shards[i].split_at(keyAt(i, keep), moved);
+    absorb(i + 1, moved);
+
+  } else if (keep > size) {
+    std::size_t needed = keep - size;
+
+    if (needed == shards[i + 1].size()) {
+      absorb(i, shards[i + 1]);
+      return;
+    }
+
+    // the upper part stays on the pools of shard i + 1 and goes back to it
+    Tree upper;
+    shards[i + 1].split_at(keyAt(i + 1, needed), upper);
+    absorb(i, shards[i + 1]);
+    shards[i + 1].join(upper);
+  }
+}
+
+/**
+ * Derives the bounds from the smallest key of every shard after rebalance()
+ * moved keys between them.
+ */
+template <typename K, typename V, std::size_t N, std::size_t Shards,
+          typename Alloc, bool Ranked, typename Agg, typename Stats>
+void ShardedBPlusTree<K, V, N, Shards, Alloc, Ranked, Agg,
+                      Stats>::resetBounds() {
+  std::size_t used = Shards;
+
+  while (used > 1 && shards[used - 1].empty()) {
+    used--;
+  }
+
+  bounds.clear();
+
+  for (std::size_t i = 1; i < used; i++) {
+    std::size_t next = i;
+
+    while (shards[next].empty()) {
+      next++;
+    }
+
+    bounds.push_back(shards[next].begin().key());
+  }
+}
+
+/**
+ * Front end for BPlusTree meant for vast numbers of tiny trees. Up to N
+ * entries are kept sorted in a leaf inside the object itself, with values
+ * stored in place, so constructing one allocates nothing and an idle tree
+ * holds no pools. The first insert beyond N moves the entries into a
+ * BPlusTree, whose pools are only set up then, and the inline leaf takes over
+ * again once that tree has been emptied.
+ */
+template <typename Key, typename Value, std::size_t N,
+          typename ValueAllocator = SegmentedFreelistAllocator<Value>,
+          bool OrderStatistics = false, typename Aggregate = NoAggregate,
+          typename Stats = NoStats>
+class SmallBPlusTree {
+public:
+  using key_type = Key;
+  using value_type = Value;
+  using Tree = BPlusTree<Key, Value, N, ValueAllocator, OrderStatistics,
+                         Aggregate, Stats>;
+
+private:
+  static constexpr bool keysOnly = std::is_same_v<Value, NoValue>;
+
+  struct Empty {};
+
+  // storage for a value that only exists while its entry does
+  union Slot {
+    Value value;
+
+    Slot() {}
+    ~Slot() {}
+  };
+
+  std::size_t count = 0; // entries in the inline leaf
+  Key keys[N];
+  [[no_unique_address]] std::conditional_t<keysOnly, Empty, Slot[N]> slots;
+  std::unique_ptr<Tree> tree; // holds the entries once they don't fit inline
+
+  std::size_t position(const key_type &key) const {
+    return std::lower_bound(keys, keys + count, key) - keys;
+  }
+
+  bool holds(std::size_t i, const key_type &key) const {
+    return i < count && keys[i] == key;
+  }
+
+  auto &entry(std::size_t i) {
+    if constexpr (keysOnly) {
+      return std::as_const(keys[i]);
+    } else {
+      return slots[i].value;
+    }
+  }
+
+  void openSlot(std::size_t);
+
+  void closeSlot(std::size_t);
+
+  void spill();
+
+  void take(SmallBPlusTree &&);
+
+public:
+  class SmallIterator {
+  private:
+    friend class SmallBPlusTree;
+
+    SmallBPlusTree *owner;
+    std::size_t idx; // position in the inline leaf
+    typename Tree::iterator it;
+
+    SmallIterator(SmallBPlusTree *owner, std::size_t idx,
+                  typename Tree::iterator it)
+        : owner(owner), idx(idx), it(it) {}
+
+  public:
+    using value_type = typename Tree::iterator::value_type;
+
+    value_type &operator*() const {
+      return owner->tree ? *it : owner->entry(idx);
+    }
+
+    value_type *operator->() { return &**this; }
+
+    const key_type &key() const {
+      return owner->tree ? it.key() : owner->keys[idx];
+    }
+
+    SmallIterator &operator++() {
+      if (owner->tree) {
+        ++it;
+      } else {
+        idx++;
+      }
+
+      return *this;
+    }
+
+    SmallIterator operator++(int) {
+      SmallIterator temp = *this;
+      ++(*this);
+      return temp;
+    }
+
+    bool operator==(const SmallIterator &other) const {
+      return idx == other.idx && it == other.it;
+    }
+    bool operator!=(const SmallIterator &other) const {
+      return !(*this == other);
+    }
+  };
+
+  using iterator = SmallIterator;
+
+  SmallBPlusTree() = default;
+
+  SmallBPlusTree(SmallBPlusTree &&other) { take(std::move(other)); }
+
+  SmallBPlusTree &operator=(SmallBPlusTree &&other) {
+    if (this != &other) {
+      clear();
+      take(std::move(other));
+    }
+
+    return *this;
+  }
+
+  SmallBPlusTree(const SmallBPlusTree &) = delete;
+  SmallBPlusTree &operator=(const SmallBPlusTree &) = delete;
+
+  ~SmallBPlusTree() { clear(); }
+
+  // whether the entries have moved into a BPlusTree
+  bool spilled() const noexcept { return tree != nullptr; }
+
+  std::size_t size() const { return tree ? tree->size() : count; }
+
+  bool empty() const { return size() == 0; }
+
+  template <typename... Args>
+  void emplace(const key_type &key, Args &&...args);
+
+  template <typename ValueFwd>
+  void insert(const key_type &key, ValueFwd &&value) {
+    emplace(key, std::forward<ValueFwd>(value));
+  }
+
+  void insert(const std::pair<key_type, value_type> &entry) {
+    emplace(entry.first, entry.second);
+  }
+
+  void insert(const key_type &key)
+    requires keysOnly
+  {
+    emplace(key);
+  }
+
+  template <typename... Args>
+  bool try_emplace(const key_type &key, Args &&...args)
+    requires(!keysOnly);
+
+  bool erase(const key_type &key);
+
+  void clear();
+
+  bool contains(const key_type &key) const {
+    return tree ? tree->contains(key) : holds(position(key), key);
+  }
+
+  value_type &at(const key_type &key) {
+    if (tree)
+      return tree->at(key);
+
+    std::size_t i = position(key);
+
+    if (!holds(i, key))
+      throw std::out_of_range("key not found");
+
+    return entry(i);
+  }
+
+  iterator find(const key_type &key) {
+    if (tree) {
+      auto it = tree->find(key);
+      return it == tree->end() ? end() : iterator(this, 0, it);
+    }
+
+    std::size_t i = position(key);
+    return holds(i, key) ? iterator(this, i, {}) : end();
+  }
+
+  iterator begin() {
+    return tree ? iterator(this, 0, tree->begin()) : iterator(this, 0, {});
+  }
+
+  iterator end() {
+    return tree ? iterator(this, 0, tree->end()) : iterator(this, count, {});
+  }
+};
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename... Args>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::emplace(
+    const K &key, Args &&...args) {
+  if (tree) {
+    tree->emplace(key, std::forward<Args>(args)...);
+    return;
+  }
+
+  std::size_t i = position(key);
+
+  if (holds(i, key)) {
+    // assigned like in Tree::emplace, so args may refer to the old value and
+    // a throwing constructor leaves it intact
+    if constexpr (!keysOnly) {
+      V &value = slots[i].value;
+
+      if constexpr (sizeof...(Args) == 1 &&
+                    (std::is_assignable_v<V &, Args &&> && ...)) {
+        ((value = std::forward<Args>(args)), ...);
+      } else {
+        value = V(std::forward<Args>(args)...);
+      }
+    }
+
+    return;
+  }
+
+  if constexpr (keysOnly) {
+    if (count == N) {
+      spill();
+      tree->emplace(key);
+      return;
+    }
+
+    openSlot(i);
+    keys[i] = key;
+
+  } else {
+    // built before spill() or openSlot() move the inline values, which args
+    // may refer to, and so that a throwing constructor leaves them intact
+    V value(std::forward<Args>(args)...);
+
+    if (count == N) {
+      spill();
+      tree->emplace(key, std::move(value));
+      return;
+    }
+
+    openSlot(i);
+    keys[i] = key;
+    std::construct_at(&slots[i].value, std::move(value));
+  }
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+template <typename... Args>
+bool SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::try_emplace(
+    const K &key, Args &&...args)
+  requires(!keysOnly)
+{
+  if (tree)
+    return tree->try_emplace(key, std::forward<Args>(args)...);
+
+  if (holds(position(key), key))
+    return false;
+
+  emplace(key, std::forward<Args>(args)...);
+  return true;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+bool SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::erase(const K &key) {
+  if (tree) {
+    bool erased = tree->erase(key);
+
+    if (tree->size() == 0) {
+      tree.reset();
+    }
+
+    return erased;
+  }
+
+  std::size_t i = position(key);
+
+  if (!holds(i, key))
+    return false;
+
+  closeSlot(i);
+  return true;
+}
+
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::clear() {
+  tree.reset();
+
+  if constexpr (!keysOnly) {
+    for (std::size_t i = 0; i < count; i++) {
+      std::destroy_at(&slots[i].value);
+    }
+  }
+
+  count = 0;
+}
+
+/**
+ * Makes room for an entry at i. Values are moved up one slot each, leaving
+ * slot i without a value.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::openSlot(
+    std::size_t i) {
+  assert(count < N);
+
+  for (std::size_t j = count; j > i; j--) {
+    keys[j] = std::move(keys[j - 1]);
+
+    if constexpr (!keysOnly) {
+      std::construct_at(&slots[j].value, std::move(slots[j - 1].value));
+      std::destroy_at(&slots[j - 1].value);
+    }
+  }
+
+  count++;
+}
+
+// removes the entry at i and moves the following ones down
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::closeSlot(
+    std::size_t i) {
+  if constexpr (!keysOnly) {
+    std::destroy_at(&slots[i].value);
+  }
+
+  for (std::size_t j = i + 1; j < count; j++) {
+    keys[j - 1] = std::move(keys[j]);
+
+    if constexpr (!keysOnly) {
+      std::construct_at(&slots[j - 1].value, std::move(slots[j].value));
+      std::destroy_at(&slots[j].value);
+    }
+  }
+
+  count--;
+}
+
+/**
+ * Moves the inline entries into a new BPlusTree. They arrive in key order, so
+ * each insert takes the tree's append fast path.
+ */
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::spill() {
+  auto spilled = std::make_unique<Tree>();
+
+  for (std::size_t i = 0; i < count; i++) {
+    if constexpr (keysOnly) {
+      spilled->insert(keys[i]);
+    } else {
+      spilled->emplace(keys[i], std::move(slots[i].value));
+    }
+  }
 
-  } else {
+  clear();
+  tree = std::move(spilled);
+}
 
-    insert<Args...>(1, root, key, std::forward<Args>(args)...);
-    keyCount++;
+// takes over the entries of other, which is left empty
+template <typename K, typename V, std::size_t N, typename Alloc, bool Ranked,
+          typename Agg, typename Stats>
+void SmallBPlusTree<K, V, N, Alloc, Ranked, Agg, Stats>::take(
+    SmallBPlusTree &&other) {
+  assert(count == 0 && !tree);
 
-    if (root->size > N) {
-      Node *newRoot = nodeAllocator.allocate(1);
-      std::construct_at(newRoot, root);
+  tree = std::move(other.tree);
 
-      split(newRoot, 0, height <= 1);
-      root = newRoot;
-      height++;
+  for (std::size_t i = 0; i < other.count; i++) {
+    keys[i] = std::move(other.keys[i]);
+
+    if constexpr (!keysOnly) {
+      std::construct_at(&slots[i].value, std::move(other.slots[i].value));
     }
   }
-}
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-template <typename ValueFwd>
-void BPlusTree<K, V, N, Alloc>::insert(const K &key, ValueFwd &&value) {
-  emplace(key, std::forward<ValueFwd>(value));
+  count = other.count;
+  other.clear();
 }
 
 /**
- * Searches keys of node. If key is found return index of right child of the
- * key. Otherwise return index of the right child of the first key greater than
- * the target.
+ * Ordered container for integral keys such as dense IDs that packs the keys
+ * of each leaf. A leaf stores its keys as deltas from a base no larger than
+ * any of them, in lanes of the fewest bytes, 1, 2 or 4, that hold the largest
+ * delta. Leaves whose keys span too wide a range for lanes narrower than the
+ * keys keep them at full width, uncompressed. Lanes are searched with a
+ * branchless count that compilers vectorize, so finding a key within a leaf
+ * of LeafSize keys is one pass over a few cache lines, and dense keys take a
+ * byte each instead of sizeof(Key).
+ *
+ * The leaves hang below a BPlusTree of fanout N that maps the largest key a
+ * leaf may hold to the leaf, the last one taking all keys up to the largest
+ * key_type. Values are kept in order next to the lanes of their leaf. Keys
+ * are decoded on the fly, so key() and the entries of sets are copies rather
+ * than references, and for_each() decodes whole leaves at once.
  */
-template <typename K, typename V, std::size_t N, typename Alloc>
-bool BPlusTree<K, V, N, Alloc>::findKeyInNode(Node *node, const K &key,
-                                              std::size_t &idx) const {
-  assert(node->size <= N);
-
-  if constexpr (N < 200) {
-    // linear search
-    for (idx = node->size; idx > 0; idx--) {
-      if (key == node->keys[idx - 1])
-        return true;
+template <typename Key, typename Value, std::size_t N,
+          std::size_t LeafSize = 256>
+class PackedBPlusTree {
+public:
+  using key_type = Key;
+  using value_type = Value;
 
-      if (key > node->keys[idx - 1])
-        break;
-    }
+  static_assert(std::is_integral_v<Key> && !std::is_same_v<Key, bool>,
+                "packed leaves need integral keys");
+  static_assert(LeafSize >= 4, "leaves must hold at least four keys");
 
-  } else {
-    // binary search
-    std::size_t start = 0;
-    std::size_t end = node->size;
+private:
+  static constexpr bool keysOnly = std::is_same_v<Value, NoValue>;
 
-    while (start < end) {
-      std::size_t pivot = start + (end - start) / 2;
+  struct Empty {};
 
-      if (node->keys[pivot] == key) {
-        idx = pivot + 1;
-        return true;
-      }
+  // keys map to unsigned integers of the same order, deltas are taken there
+  using Bits = std::make_unsigned_t<Key>;
 
-      else if (node->keys[pivot] < key) {
-        start = pivot + 1;
-      } else {
-        end = pivot;
-      }
+  static Bits bits(const key_type &key) {
+    if constexpr (std::is_signed_v<key_type>) {
+      return static_cast<Bits>(key) ^ (Bits(1) << (sizeof(Bits) * 8 - 1));
+    } else {
+      return key;
     }
+  }
 
-    idx = start;
+  static key_type fromBits(Bits keyBits) {
+    if constexpr (std::is_signed_v<key_type>) {
+      return static_cast<key_type>(keyBits ^
+                                   (Bits(1) << (sizeof(Bits) * 8 - 1)));
+    } else {
+      return keyBits;
+    }
   }
 
-  return false;
-}
+  // deltas of a leaf, all in lanes of one width
+  using Lanes = std::variant<std::vector<std::uint8_t>,
+                             std::vector<std::uint16_t>,
+                             std::vector<std::uint32_t>,
+                             std::vector<std::uint64_t>>;
+
+  struct Leaf {
+    Bits base = 0; // no larger than the bits of any key of the leaf
+    Lanes lanes;
+    [[no_unique_address]] std::conditional_t<keysOnly, Empty,
+                                             std::vector<Value>> values;
+
+    std::size_t size() const {
+      return std::visit([](const auto &deltas) { return deltas.size(); },
+                        lanes);
+    }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-template <typename... Args>
-void BPlusTree<K, V, N, Alloc>::insert(unsigned depth, Node *node, const K &key,
-                                       Args &&...args) {
-  bool isLeaf = depth >= height;
+    key_type key(std::size_t i) const {
+      return fromBits(base + std::visit(
+                                 [i](const auto &deltas) -> Bits {
+                                   return deltas[i];
+                                 },
+                                 lanes));
+    }
 
-  std::size_t idx;
-  bool foundInCurrentNode = findKeyInNode(node, key, idx);
+    // number of keys smaller than key, counted without branches
+    std::size_t position(const key_type &key) const {
+      Bits keyBits = bits(key);
 
-  if (isLeaf) { // if not leaf
-    if (foundInCurrentNode) {
-      // replace
-      *node->values[idx - 1] = V(std::forward<Args>(args)...);
-      keyCount--;
+      if (keyBits <= base)
+        return 0;
 
-    } else {
-      V *value = valueAllocator.allocate(1);
-      std::construct_at(value, std::forward<Args>(args)...);
-      insertLeaf(node, idx, key, value);
-    }
+      return std::visit(
+          [delta = Bits(keyBits - base)](const auto &deltas) {
+            using Lane = typename std::decay_t<decltype(deltas)>::value_type;
 
-  } else {
-    insert<Args...>(depth + 1, node->children[idx], key,
-                    std::forward<Args>(args)...);
+            if (delta > std::numeric_limits<Lane>::max())
+              return deltas.size();
 
-    if (node->children[idx]->size > N) {
-      split(node, idx, depth + 1 >= height);
+            Lane target = static_cast<Lane>(delta);
+            std::size_t smaller = 0;
+
+            for (Lane lane : deltas) {
+              smaller += lane < target;
+            }
+
+            return smaller;
+          },
+          lanes);
     }
-  }
+  };
 
-  assert(node->size <= N + 1);
-}
+  using Index = BPlusTree<Key, Leaf, N>;
+  using LeafIterator = typename Index::iterator;
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-const V &BPlusTree<K, V, N, Alloc>::at(const K &key) const {
-  const_iterator it = find(key);
+  Index index;
+  std::size_t count = 0;
 
-  if (it == cend())
-    throw std::out_of_range("key not found");
+  static std::vector<Bits> unpack(const Leaf &);
 
-  return *it;
-}
+  static void pack(Leaf &, const Bits *, const Bits *);
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-V &BPlusTree<K, V, N, Alloc>::at(const K &key) {
-  iterator it = find(key);
+  LeafIterator leafFor(const key_type &key) { return index.lower_bound(key); }
 
-  if (it == end())
-    throw std::out_of_range("key not found");
+  template <typename... Args>
+  void insertAt(Leaf &, std::size_t, const key_type &, Args &&...);
 
-  return *it;
-}
+  key_type split(Leaf &);
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-bool BPlusTree<K, V, N, Alloc>::contains(const K &key) const noexcept {
-  return find<const_iterator>(root, key, 1) != cend();
-}
+  void merge(LeafIterator, LeafIterator);
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-BPlusTree<K, V, N, Alloc>::iterator
-BPlusTree<K, V, N, Alloc>::find(const K &key) {
-  return find<iterator>(root, key, 1);
-}
+  void rebalance(LeafIterator);
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-BPlusTree<K, V, N, Alloc>::const_iterator
-BPlusTree<K, V, N, Alloc>::find(const K &key) const {
-  return find<const_iterator>(root, key, 1);
-}
+public:
+  class PackedIterator {
+  private:
+    friend class PackedBPlusTree;
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-template <typename Iterator>
-Iterator BPlusTree<K, V, N, Alloc>::find(Node *node, const K &key,
-                                         unsigned depth) const {
-  if (!root)
-    return Iterator();
+    LeafIterator leaf;
+    std::size_t idx; // position in the leaf
 
-  bool isLeaf = depth >= height;
+    PackedIterator(LeafIterator leaf, std::size_t idx) : leaf(leaf), idx(idx) {}
 
-  std::size_t idx;
-  bool found = findKeyInNode(node, key, idx);
+  public:
+    using value_type = std::conditional_t<keysOnly, const Key, Value>;
 
-  if (isLeaf) {
-    if (found) {
-      return Iterator(node, idx - 1, true);
-    } else {
-      return Iterator();
+    // sets hand out decoded copies of their keys
+    decltype(auto) operator*() const {
+      if constexpr (keysOnly) {
+        return key();
+      } else {
+        return (*leaf).values[idx];
+      }
     }
 
-  } else {
-    return find<Iterator>(node->children[idx], key, depth + 1);
-  }
-}
+    key_type key() const { return (*leaf).key(idx); }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-bool BPlusTree<K, V, N, Alloc>::erase(const K &key) {
-  if (!root)
-    return false;
+    PackedIterator &operator++() {
+      if (++idx == (*leaf).size()) {
+        ++leaf;
+        idx = 0;
+      }
 
-  if (keyCount == 1 && root->keys[0] == key) {
-    assert(minNode == root);
-    assert(minNode->next == nullptr);
-    clear();
-    return true;
-  }
+      return *this;
+    }
 
-  bool retval = erase(1, root, key);
+    PackedIterator operator++(int) {
+      PackedIterator temp = *this;
+      ++(*this);
+      return temp;
+    }
 
-  // check if height needs to shrink
-  if (root->size == 0) {
-    Node *newRoot = root->children[0];
-    std::destroy_at(root);
-    nodeAllocator.deallocate(root, 1);
-    root = newRoot;
-    height--;
+    bool operator==(const PackedIterator &other) const {
+      return leaf == other.leaf && idx == other.idx;
+    }
+    bool operator!=(const PackedIterator &other) const {
+      return !(*this == other);
+    }
+  };
+
+  using iterator = PackedIterator;
+
+  std::size_t size() const { return count; }
+
+  bool empty() const { return count == 0; }
+
+  template <typename... Args>
+  void emplace(const key_type &key, Args &&...args);
+
+  template <typename ValueFwd>
+  void insert(const key_type &key, ValueFwd &&value) {
+    emplace(key, std::forward<ValueFwd>(value));
   }
 
-  if (retval) {
-    keyCount--;
+  void insert(const std::pair<key_type, value_type> &entry) {
+    emplace(entry.first, entry.second);
   }
 
-  return retval;
-}
+  void insert(const key_type &key)
+    requires keysOnly
+  {
+    emplace(key);
+  }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-bool BPlusTree<K, V, N, Alloc>::erase(unsigned depth, Node *node,
-                                      const K &key) {
+  bool erase(const key_type &key);
 
-  // find key in current node
-  std::size_t idx;
-  bool isLeaf = depth >= height;
-  bool childIsLeaf = depth + 1 >= height;
-  bool found = findKeyInNode(node, key, idx);
+  void clear() {
+    index.clear();
+    count = 0;
+  }
 
-  if (isLeaf) {
-    if (found) {
-      // remove from leaf
-      std::destroy_at(node->values[idx - 1]);
-      valueAllocator.deallocate(node->values[idx - 1], 1);
-      removeKeyFromLeaf(node, idx - 1);
-      return true;
+  iterator find(const key_type &key);
 
-    } else {
-      // nothing to do
+  iterator lower_bound(const key_type &key);
+
+  bool contains(const key_type &key) const {
+    if (count == 0)
       return false;
-    }
+
+    const Leaf &leaf = *index.lower_bound(key);
+    std::size_t pos = leaf.position(key);
+    return pos < leaf.size() && leaf.key(pos) == key;
   }
 
-  bool retval;
-  Node *child;
+  value_type &at(const key_type &key)
+    requires(!keysOnly)
+  {
+    iterator it = find(key);
 
-  if (found) {
-    // find next smallest and largest
-    // swap smaller with current key and replace larger
-    idx--;
-    child = node->children[idx];
+    if (it == end())
+      throw std::out_of_range("key not found");
 
-    unsigned currentDepth = depth + 1;
-    Node *nextSmallest = child;
-    Node *nextLargest = node->children[idx + 1];
+    return *it;
+  }
 
-    while (currentDepth < height) {
-      nextSmallest = nextSmallest->children[nextSmallest->size];
-      nextLargest = nextLargest->children[0];
-      currentDepth++;
-    }
+  template <typename Fn> void for_each(Fn fn);
 
-    assert(nextLargest->keys[0] == key &&
-           "Inner node must have duplicate key as direct successor");
+  iterator begin() { return iterator(index.begin(), 0); }
 
-    V *valueToErase = nextLargest->values[0];
-    const K &nextSmallestKey = nextSmallest->keys[nextSmallest->size - 1];
+  iterator end() { return iterator(index.end(), 0); }
+};
 
-    // duplicate key of nextSmallest as inner node
-    nextLargest->keys[0] = nextSmallestKey;
-    node->keys[idx] = nextSmallestKey;
+// the bits of all keys of leaf, in order
+template <typename K, typename V, std::size_t N, std::size_t L>
+std::vector<typename PackedBPlusTree<K, V, N, L>::Bits>
+PackedBPlusTree<K, V, N, L>::unpack(const Leaf &leaf) {
+  std::vector<Bits> keys(leaf.size());
+
+  std::visit(
+      [&](const auto &deltas) {
+        for (std::size_t i = 0; i < deltas.size(); i++) {
+          keys[i] = leaf.base + deltas[i];
+        }
+      },
+      leaf.lanes);
+
+  return keys;
+}
 
-    // swap value nodes
-    V *nextSmallestValue = nextSmallest->values[nextSmallest->size - 1];
-    nextSmallest->values[nextSmallest->size - 1] = valueToErase;
-    nextLargest->values[0] = nextSmallestValue;
+/**
+ * Lays out the ascending key bits in [first, last) as deltas from the first
+ * of them, in the narrowest lanes that hold the last delta but no wider than
+ * the keys themselves.
+ */
+template <typename K, typename V, std::size_t N, std::size_t L>
+void PackedBPlusTree<K, V, N, L>::pack(Leaf &leaf, const Bits *first,
+                                       const Bits *last) {
+  leaf.base = first == last ? 0 : *first;
+  Bits span = first == last ? 0 : last[-1] - leaf.base;
+
+  auto fill = [&](auto &deltas) {
+    using Lane = typename std::decay_t<decltype(deltas)>::value_type;
+    deltas.resize(last - first);
+
+    for (std::size_t i = 0; i < deltas.size(); i++) {
+      deltas[i] = static_cast<Lane>(first[i] - leaf.base);
+    }
+  };
 
-    erase(depth + 1, child, nextSmallestKey);
-    retval = true;
+  std::size_t width = 1; // bytes per lane
 
-  } else {
-    child = node->children[idx];
-    retval = erase(depth + 1, child, key);
+  while (width < sizeof(Bits) && span >> (width * 8) != 0) {
+    width *= 2;
   }
 
-  // rebalance tree
-  constexpr std::size_t MIN_KEYS = N / 2;
-
-  if (child->size >= MIN_KEYS) {
-    return retval;
+  switch (width) {
+  case 1:
+    fill(leaf.lanes.template emplace<0>());
+    break;
+  case 2:
+    fill(leaf.lanes.template emplace<1>());
+    break;
+  case 4:
+    fill(leaf.lanes.template emplace<2>());
+    break;
+  default:
+    fill(leaf.lanes.template emplace<3>());
   }
+}
 
-  assert(child->size == MIN_KEYS - 1);
+/**
+ * Inserts key with a value constructed from args, or assigns that value to an
+ * existing key. A full leaf first gives its lower half to a new leaf.
+ */
+template <typename K, typename V, std::size_t N, std::size_t L>
+template <typename... Args>
+void PackedBPlusTree<K, V, N, L>::emplace(const K &key, Args &&...args) {
+  if (count == 0) {
+    index.emplace(std::numeric_limits<K>::max(), Leaf());
+  }
 
-  // try steal child from left sibling
-  Node *leftSibling = idx > 0 ? node->children[idx - 1] : nullptr;
-  if (leftSibling && leftSibling->size > MIN_KEYS) {
+  LeafIterator it = leafFor(key);
+  Leaf *leaf = &*it;
+  std::size_t pos = leaf->position(key);
 
-    if (childIsLeaf) {
-      // rotate keys
-      node->keys[idx - 1] = leftSibling->keys[leftSibling->size - 1];
-      insertLeaf(child, 0, node->keys[idx - 1],
-                 leftSibling->values[leftSibling->size - 1]);
+  if (pos < leaf->size() && leaf->key(pos) == key) {
+    if constexpr (!keysOnly) {
+      V &value = leaf->values[pos];
 
-    } else {
-      // rotate keys
-      insertInner(child, 0, std::move(node->keys[idx - 1]), child->children[0]);
-      child->children[0] = leftSibling->children[leftSibling->size];
-      node->keys[idx - 1] = std::move(leftSibling->keys[leftSibling->size - 1]);
+      if constexpr (sizeof...(Args) == 1 &&
+                    (std::is_assignable_v<V &, Args &&> && ...)) {
+        ((value = std::forward<Args>(args)), ...);
+      } else {
+        value = V(std::forward<Args>(args)...);
+      }
     }
 
-    leftSibling->size--;
-    return retval;
+    return;
   }
 
-  // try steal child from right sibling
-  Node *rightSibling = idx < node->size ? node->children[idx + 1] : nullptr;
-  if (rightSibling && rightSibling->size > MIN_KEYS) {
-
-    if (childIsLeaf) {
-      // rotate keys
-      assert(rightSibling->keys[0] == node->keys[idx]);
-
-      child->keys[MIN_KEYS - 1] = rightSibling->keys[0];
-      child->values[MIN_KEYS - 1] = rightSibling->values[0];
-      child->size++;
-      removeKeyFromLeaf(rightSibling, 0);
-      node->keys[idx] = rightSibling->keys[0];
+  if (leaf->size() == L) {
+    K fence = split(*leaf);
 
-    } else {
-      // rotate keys
-      insertInner(child, MIN_KEYS - 1, std::move(node->keys[idx]),
-                  rightSibling->children[0]);
-
-      node->keys[idx] = rightSibling->keys[0];
-      removeInnerKey(rightSibling, 0);
+    if (!(fence < key)) {
+      leaf = &*index.find(fence);
     }
 
-    return retval;
+    pos = leaf->position(key);
   }
 
-  // merge with left
-  if (leftSibling) {
-    assert(leftSibling->size == MIN_KEYS);
+  insertAt(*leaf, pos, key, std::forward<Args>(args)...);
+  count++;
+}
 
-    if (childIsLeaf) {
-      for (std::size_t i = 0; i < MIN_KEYS - 1; i++) {
-        leftSibling->keys[MIN_KEYS + i] = std::move(child->keys[i]);
-        leftSibling->values[MIN_KEYS + i] = child->values[i];
-      }
+// inserts key at pos of leaf, which is laid out anew if key doesn't fit its
+// lanes
+template <typename K, typename V, std::size_t N, std::size_t L>
+template <typename... Args>
+void PackedBPlusTree<K, V, N, L>::insertAt(Leaf &leaf, std::size_t pos,
+                                           const K &key, Args &&...args) {
+  if constexpr (!keysOnly) {
+    leaf.values.emplace(leaf.values.begin() + pos,
+                        std::forward<Args>(args)...);
+  }
 
-      leftSibling->size = 2 * MIN_KEYS - 1;
-      leftSibling->next = child->next;
+  Bits keyBits = bits(key);
 
-      if (child->next) {
-        child->next->prev = leftSibling;
-      } else {
-        assert(child == maxNode);
-        maxNode = leftSibling;
-      }
+  bool fits = std::visit(
+      [&](auto &deltas) {
+        using Lane = typename std::decay_t<decltype(deltas)>::value_type;
 
-    } else {
-      leftSibling->keys[MIN_KEYS] = std::move(node->keys[idx - 1]);
-      leftSibling->children[MIN_KEYS + 1] = child->children[0];
+        if (keyBits < leaf.base ||
+            Bits(keyBits - leaf.base) > std::numeric_limits<Lane>::max())
+          return false;
 
-      for (std::size_t i = 0; i < MIN_KEYS - 1; i++) {
-        leftSibling->keys[MIN_KEYS + i + 1] = std::move(child->keys[i]);
-        leftSibling->children[MIN_KEYS + i + 2] = child->children[i + 1];
-      }
+        deltas.insert(deltas.begin() + pos,
+                      static_cast<Lane>(keyBits - leaf.base));
+        return true;
+      },
+      leaf.lanes);
 
-      leftSibling->size = 2 * MIN_KEYS;
-    }
+  if (!fits) {
+    std::vector<Bits> keys = unpack(leaf);
+    keys.insert(keys.begin() + pos, keyBits);
+    pack(leaf, keys.data(), keys.data() + keys.size());
+  }
+}
 
-    assert(!isLeaf);
-    std::destroy_at(child);
-    nodeAllocator.deallocate(child, 1);
+// moves the lower half of leaf into a new leaf and returns its fence
+template <typename K, typename V, std::size_t N, std::size_t L>
+K PackedBPlusTree<K, V, N, L>::split(Leaf &leaf) {
+  std::vector<Bits> keys = unpack(leaf);
+  std::size_t half = keys.size() / 2;
+  Leaf lower;
+
+  pack(lower, keys.data(), keys.data() + half);
+  pack(leaf, keys.data() + half, keys.data() + keys.size());
+
+  if constexpr (!keysOnly) {
+    auto middle = leaf.values.begin() + half;
+    lower.values.assign(std::make_move_iterator(leaf.values.begin()),
+                        std::make_move_iterator(middle));
+    leaf.values.erase(leaf.values.begin(), middle);
+  }
 
-    removeInnerKey(node, idx - 1); // remove child
-    node->children[idx - 1] = leftSibling;
+  K fence = fromBits(keys[half - 1]);
+  index.emplace(fence, std::move(lower));
+  return fence;
+}
 
-  } else {
-    // merge right
-    assert(rightSibling);
-    assert(rightSibling->size == MIN_KEYS);
+/**
+ * Erases key and returns whether it existed. A leaf left with fewer than a
+ * quarter of LeafSize keys is merged into a neighbour if the two fill no more
+ * than three quarters of a leaf, and an empty one always is.
+ */
+template <typename K, typename V, std::size_t N, std::size_t L>
+bool PackedBPlusTree<K, V, N, L>::erase(const K &key) {
+  if (count == 0)
+    return false;
 
-    if (childIsLeaf) {
-      for (std::size_t i = 0; i < MIN_KEYS; i++) {
-        child->keys[MIN_KEYS + i - 1] = std::move(rightSibling->keys[i]);
-        child->values[MIN_KEYS + i - 1] = rightSibling->values[i];
-      }
+  LeafIterator it = leafFor(key);
+  Leaf &leaf = *it;
+  std::size_t pos = leaf.position(key);
 
-      child->size = 2 * MIN_KEYS - 1;
-      child->next = rightSibling->next;
+  if (pos == leaf.size() || !(leaf.key(pos) == key))
+    return false;
 
-      if (rightSibling->next) {
-        rightSibling->next->prev = child;
-      } else {
-        assert(rightSibling == maxNode);
-        maxNode = child;
-      }
+  std::visit([pos](auto &deltas) { deltas.erase(deltas.begin() + pos); },
+             leaf.lanes);
 
-    } else {
-      child->keys[MIN_KEYS - 1] = std::move(node->keys[idx]);
-      child->children[MIN_KEYS] = rightSibling->children[0];
+  if constexpr (!keysOnly) {
+    leaf.values.erase(leaf.values.begin() + pos);
+  }
 
-      for (std::size_t i = 0; i < MIN_KEYS; i++) {
-        child->keys[MIN_KEYS + i] = std::move(rightSibling->keys[i]);
-        child->children[MIN_KEYS + i + 1] = rightSibling->children[i + 1];
-      }
+  if (--count == 0) {
+    clear();
+  } else if (leaf.size() < L / 4) {
+    rebalance(it);
+  }
 
-      child->size = 2 * MIN_KEYS;
-    }
+  return true;
+}
 
-    std::destroy_at(rightSibling);
-    nodeAllocator.deallocate(rightSibling, 1);
+// merges the leaf at it, which has fallen below a quarter of LeafSize keys,
+// with a neighbour
+template <typename K, typename V, std::size_t N, std::size_t L>
+void PackedBPlusTree<K, V, N, L>::rebalance(LeafIterator it) {
+  std::size_t size = (*it).size();
+  LeafIterator next = it;
+  ++next;
+
+  if (next != index.end() &&
+      (size == 0 || size + (*next).size() <= L * 3 / 4)) {
+    merge(it, next);
+  } else if (it != index.begin()) {
+    LeafIterator prev = it;
+    --prev;
+
+    if (size == 0 || (*prev).size() + size <= L * 3 / 4) {
+      merge(prev, it);
+    }
+  }
+}
 
-    // remove right sibling by shifting nodes
-    removeInnerKey(node, idx);
-    node->children[0] = child;
+// moves the keys of lower into upper, the leaf right above it, and drops lower
+template <typename K, typename V, std::size_t N, std::size_t L>
+void PackedBPlusTree<K, V, N, L>::merge(LeafIterator lower,
+                                        LeafIterator upper) {
+  Leaf &from = *lower;
+  Leaf &to = *upper;
+  std::vector<Bits> keys = unpack(from);
+  std::vector<Bits> upperKeys = unpack(to);
+
+  keys.insert(keys.end(), upperKeys.begin(), upperKeys.end());
+  pack(to, keys.data(), keys.data() + keys.size());
+
+  if constexpr (!keysOnly) {
+    to.values.insert(to.values.begin(),
+                     std::make_move_iterator(from.values.begin()),
+                     std::make_move_iterator(from.values.end()));
   }
 
-  return retval;
+  K fence = lower.key();
+  index.erase(fence);
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-void BPlusTree<K, V, N, Alloc>::freeValues(Node *node) {
-  if (!node)
-    return;
+template <typename K, typename V, std::size_t N, std::size_t L>
+PackedBPlusTree<K, V, N, L>::iterator
+PackedBPlusTree<K, V, N, L>::find(const K &key) {
+  if (count == 0)
+    return end();
 
-  Node *next = node->next;
+  LeafIterator it = leafFor(key);
+  std::size_t pos = (*it).position(key);
 
-  for (std::size_t i = 0; i < node->size; i++) {
-    std::destroy_at(node->values[i]);
-    valueAllocator.deallocate(node->values[i], 1);
-  }
+  if (pos == (*it).size() || !((*it).key(pos) == key))
+    return end();
 
-  freeValues(next);
+  return iterator(it, pos);
 }
 
-template <typename K, typename V, std::size_t N, typename Alloc>
-void BPlusTree<K, V, N, Alloc>::clear() {
-  freeValues(minNode);
-  nodeAllocator.reset();
-  keyCount = 0;
-  height = 0;
-  root = nullptr;
-  minNode = nullptr;
-  maxNode = nullptr;
+/**
+ * Returns an iterator to the first key not less than key.
+ */
+template <typename K, typename V, std::size_t N, std::size_t L>
+PackedBPlusTree<K, V, N, L>::iterator
+PackedBPlusTree<K, V, N, L>::lower_bound(const K &key) {
+  if (count == 0)
+    return end();
+
+  LeafIterator it = leafFor(key);
+  std::size_t pos = (*it).position(key);
+
+  if (pos == (*it).size())
+    return iterator(++it, 0);
+
+  return iterator(it, pos);
+}
+
+/**
+ * Calls fn with each key, and with its value for maps, in key order. Each
+ * leaf is decoded in one pass the compiler can vectorize before fn sees its
+ * keys.
+ */
+template <typename K, typename V, std::size_t N, std::size_t L>
+template <typename Fn>
+void PackedBPlusTree<K, V, N, L>::for_each(Fn fn) {
+  Bits keys[L];
+
+  for (Leaf &leaf : index) {
+    std::size_t size = leaf.size();
+
+    std::visit(
+        [&](const auto &deltas) {
+          for (std::size_t i = 0; i < size; i++) {
+            keys[i] = leaf.base + deltas[i];
+          }
+        },
+        leaf.lanes);
+
+    for (std::size_t i = 0; i < size; i++) {
+      if constexpr (keysOnly) {
+        fn(fromBits(keys[i]));
+      } else {
+        fn(fromBits(keys[i]), leaf.values[i]);
+      }
+    }
+  }
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdlib>
@@ -8,6 +9,9 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+#include "cacheline.hpp"
 
 
 template<typename K, typename V, std::size_t N = 4>
@@ -16,10 +20,14 @@ class BTree {
 static_assert(N >= 2, "N must be greater or equal to 2");
 
 private:
+    // entries are compared with branches and interleave keys with values, so
+    // scanning them only beats bisection while they fit in two cache lines
+    static constexpr std::size_t LINEAR_SEARCH_ENTRIES = 2 * CACHE_LINE_SIZE / sizeof(std::pair<K, V>);
+
     struct Node {
         std::size_t size;
         std::pair<K, V> entries[N + 1];
-        Node* children[N + 2];
+        Node* children[N + 2] = {}; // all null in leaves, see validate()
 
         public:
         Node() {}
@@ -67,6 +75,42 @@ private:
 
     void free_all(Node* node, unsigned depth);
 
+public:
+    // shape of the tree as reported by analyze(), see BPlusTree::Report
+    struct Report {
+        static constexpr std::size_t FILL_BUCKETS = 10;
+
+        struct Level {
+            std::size_t nodes = 0;
+            std::size_t keys = 0;
+            std::size_t fill[FILL_BUCKETS] = {};
+        };
+
+        std::vector<Level> levels; // starting at the root
+        std::size_t nodeBytes = 0;
+        std::size_t unusedBytes = 0; // in entry and child slots
+
+        friend std::ostream& operator<<(std::ostream& os, const Report& report) {
+            for (std::size_t i = 0; i < report.levels.size(); i++) {
+                const Level& level = report.levels[i];
+                os << "level " << i << ": " << level.nodes << " nodes, " << level.keys << " keys, fill";
+
+                for (std::size_t bucket : level.fill) {
+                    os << ' ' << bucket;
+                }
+
+                os << '\n';
+            }
+
+            return os << "bytes: " << report.nodeBytes << " nodes (" << report.unusedBytes << " unused)\n";
+        }
+    };
+
+private:
+    std::size_t validate_aux(const Node* node, unsigned depth, const K* lo, const K* hi) const;
+
+    void analyze_aux(const Node* node, unsigned depth, Report& report) const;
+
 public:
     BTree() : root(nullptr) {};
 
@@ -108,6 +152,10 @@ public:
 
     bool contains(const K& key) const;
 
+    void validate() const;
+
+    Report analyze() const;
+
     std::string toString() const {
         std::ostringstream sb;
         sb << "digraph {" << std::endl;
@@ -153,10 +201,11 @@ static inline void removeKeyFromNode(auto* node, std::size_t i) {
 template<typename K, typename V, std::size_t N>
 bool BTree<K, V, N>::findKeyInNode(Node* node, const K& key, std::size_t& idx) {
 
-    if constexpr (N < 10) {
+    if constexpr (N <= LINEAR_SEARCH_ENTRIES) {
         // linear search
         for(idx = node->size; idx > 0; idx--) {
             if(key == node->entries[idx - 1].first) {
+                idx--;
                 return true;
             }
 
@@ -311,7 +360,7 @@ void BTree<K, V, N>::insert_aux(unsigned depth, Node* node, auto&& key, auto&& v
 template<typename K, typename V, std::size_t N>
 const V& BTree<K, V, N>::at(const K& key) const {
     if (!root)
-        return false;
+        throw std::out_of_range("key");
 
     const V* value = find_aux(root, key, 1);
 
@@ -326,7 +375,7 @@ V& BTree<K, V, N>::at(const K& key) {
     if (!root)
         throw std::out_of_range("key");
 
-    const V* value = find_aux(root, key, 1);
+    V* value = find_aux(root, key, 1);
 
     if (value)
         return *value;
@@ -399,9 +448,10 @@ bool BTree<K, V, N>::erase_aux(unsigned depth, Node* node, const K& key) {
             currentDepth++;
         }
     
-        const K& nextSmallestKey = nextSmallest->entries[nextSmallest->size - 1].first;
+        // copy the key, the move below leaves the entry moved-from
+        K nextSmallestKey = nextSmallest->entries[nextSmallest->size - 1].first;
         node->entries[idx] = std::move(nextSmallest->entries[nextSmallest->size - 1]);
-        retval = erase_aux(depth + 1, child, std::move(nextSmallestKey));
+        retval = erase_aux(depth + 1, child, nextSmallestKey);
 
     } else {
         retval = erase_aux(depth + 1, child, key);
@@ -481,7 +531,7 @@ bool BTree<K, V, N>::erase_aux(unsigned depth, Node* node, const K& key) {
 
         // remove right sibling by shifting nodes
         removeKeyFromNode<K, V, N>(node, idx);
-        node->children[0] = child;
+        node->children[idx] = child;
         child->size = 2 * MIN_KEYS;
     }
 
@@ -501,9 +551,12 @@ bool BTree<K, V, N>::erase(const K& key) {
         return true;
     }
 
-    elementCount--;
     bool retval = erase_aux(1, root, key);
 
+    if (retval) {
+        elementCount--;
+    }
+
     // check if height needs to shrink
     if (root->size == 0) {
         Node* newRoot = root->children[0];
@@ -534,3 +587,125 @@ void BTree<K, V, N>:: erase_all() {
     height = 0;
     root = nullptr;
 }
+
+// checks the structural invariants and throws std::logic_error naming the first violated one
+template<typename K, typename V, std::size_t N>
+void BTree<K, V, N>::validate() const {
+    if (!root) {
+        if (elementCount != 0 || height != 0)
+            throw std::logic_error("empty tree has elements");
+
+        return;
+    }
+
+    if (validate_aux(root, 1, nullptr, nullptr) != elementCount)
+        throw std::logic_error("element count differs from entries in nodes");
+}
+
+// validates the subtree of node, whose keys must lie strictly between lo and hi, and returns its entry count
+template<typename K, typename V, std::size_t N>
+std::size_t BTree<K, V, N>::validate_aux(const Node* node, unsigned depth, const K* lo, const K* hi) const {
+    constexpr std::size_t MIN_KEYS = N / 2;
+
+    if (node->size > N)
+        throw std::logic_error("node overflows");
+
+    if (node->size == 0 || (node != root && node->size < MIN_KEYS))
+        throw std::logic_error("node underflows");
+
+    for (std::size_t i = 0; i < node->size; i++) {
+        const K& key = node->entries[i].first;
+
+        if (i > 0 && !(node->entries[i - 1].first < key))
+            throw std::logic_error("keys out of order");
+
+        if ((lo && !(*lo < key)) || (hi && !(key < *hi)))
+            throw std::logic_error("key outside of its separators");
+    }
+
+    std::size_t count = node->size;
+
+    // the tree tells leaves by depth alone, so a leaf must have no children and sit at the tree's height, and every
+    // node above that level must have all of its children
+    if (depth < height) {
+        for (std::size_t i = 0; i <= node->size; i++) {
+            const K* childLo = i > 0 ? &node->entries[i - 1].first : lo;
+            const K* childHi = i < node->size ? &node->entries[i].first : hi;
+
+            if (!node->children[i])
+                throw std::logic_error("node above the leaf level misses a child");
+
+            count += validate_aux(node->children[i], depth + 1, childLo, childHi);
+        }
+    } else {
+        for (std::size_t i = 0; i <= node->size; i++) {
+            if (node->children[i])
+                throw std::logic_error("leaf has a child below the tree's height");
+        }
+    }
+
+    return count;
+}
+
+template<typename K, typename V, std::size_t N>
+typename BTree<K, V, N>::Report BTree<K, V, N>::analyze() const {
+    Report report;
+    report.levels.resize(height);
+
+    if (root) {
+        analyze_aux(root, 1, report);
+    }
+
+    return report;
+}
+
+template<typename K, typename V, std::size_t N>
+void BTree<K, V, N>::analyze_aux(const Node* node, unsigned depth, Report& report) const {
+    typename Report::Level& level = report.levels[depth - 1];
+    level.nodes++;
+    level.keys += node->size;
+    level.fill[std::min(node->size * Report::FILL_BUCKETS / N, Report::FILL_BUCKETS - 1)]++;
+
+    report.nodeBytes += sizeof(Node);
+    report.unusedBytes += (N + 1 - node->size) * (sizeof(std::pair<K, V>) + sizeof(Node*));
+
+    if (depth < height) {
+        for (std::size_t i = 0; i <= node->size; i++) {
+            analyze_aux(node->children[i], depth + 1, report);
+        }
+    }
+}
+
+
+// bytes taken by a node of a BTree with fanout n, padding included
+template<typename K, typename V>
+constexpr std::size_t btreeNodeBytes(std::size_t n) {
+    auto roundUp = [](std::size_t bytes, std::size_t alignment) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    };
+
+    using Entry = std::pair<K, V>;
+    std::size_t entriesEnd = roundUp(sizeof(std::size_t), alignof(Entry)) + (n + 1) * sizeof(Entry);
+    std::size_t end = roundUp(entriesEnd, alignof(void*)) + (n + 2) * sizeof(void*);
+
+    return roundUp(end, std::max({alignof(std::size_t), alignof(Entry), alignof(void*)}));
+}
+
+// largest fanout whose nodes fit in TargetBytes, a whole number of cache lines
+template<typename K, typename V, std::size_t TargetBytes>
+constexpr std::size_t btreeFanout() {
+    static_assert(TargetBytes % CACHE_LINE_SIZE == 0, "target must be a multiple of the cache line size");
+    static_assert(btreeNodeBytes<K, V>(2) <= TargetBytes, "target is too small for the smallest fanout");
+
+    std::size_t n = 2;
+
+    while (btreeNodeBytes<K, V>(n + 1) <= TargetBytes) {
+        n++;
+    }
+
+    return n;
+}
+
+// BTree whose fanout fills nodes of TargetBytes as closely as possible
+template<typename K, typename V, std::size_t TargetBytes = 4096>
+using BTreeFor = BTree<K, V, btreeFanout<K, V, TargetBytes>()>;
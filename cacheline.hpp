@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+
+/**
+ * Cache line size that node layouts and node searches of BTree and BPlusTree
+ * are tuned for.
+ */
+inline constexpr std::size_t CACHE_LINE_SIZE = 64;
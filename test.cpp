@@ -0,0 +1,1617 @@
+#include "bplustree.hpp"
+#include "btree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <iterator>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <set>
+#include <string>
+#include <vector>
+
+// Explicit instantiations compile every member, so members that only build
+// for some template arguments fail here rather than in some user's code.
+template class BPlusTree<int, int, 16>;
+template class BPlusTree<int, NoValue, 16>;
+template class BPlusTree<std::string, int, 16>;
+template class BPlusTree<int, long, 16, SegmentedFreelistAllocator<long>, true,
+                         SumAggregate<long>, CountingStats>;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,             \
+                  #condition);                                                 \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+// runs a test, counting an escaping exception such as a failed validate() as
+// one more failure
+template <typename Test> static void run(const char *name, Test test) {
+  int before = failures;
+
+  try {
+    test();
+  } catch (const std::exception &e) {
+    std::printf("%s: %s\n", name, e.what());
+    failures++;
+  }
+
+  if (failures != before) {
+    std::printf("FAILED %s\n", name);
+  }
+}
+
+// checks the invariants of tree and that it holds exactly the entries of
+// model, in order
+template <typename Tree, typename Model>
+static void checkEntries(Tree &tree, const Model &model) {
+  tree.validate();
+  CHECK(tree.size() == model.size());
+
+  auto expected = model.begin();
+
+  for (auto it = tree.begin(); it != tree.end(); ++it, ++expected) {
+    if (expected == model.end()) {
+      CHECK(!"tree holds more entries than the model");
+      return;
+    }
+
+    CHECK(it.key() == expected->first);
+    CHECK(*it == expected->second);
+  }
+
+  CHECK(expected == model.end());
+}
+
+// ======= Sequential inserts =======
+
+static void testSequentialInsert() {
+  BPlusTree<int, int, 8> tree;
+  std::map<int, int> model;
+
+  for (int key = 0; key < 5000; key++) {
+    tree.insert(key, -key);
+    model[key] = -key;
+  }
+
+  checkEntries(tree, model);
+
+  // appends that overlap the existing keys replace their values
+  for (int key = 4000; key < 6000; key++) {
+    tree.insert(key, key);
+    model[key] = key;
+  }
+
+  for (int key = -1; key > -1000; key--) {
+    tree.insert(key, key);
+    model[key] = key;
+  }
+
+  checkEntries(tree, model);
+}
+
+// ======= Cursor =======
+
+static void testCursor() {
+  using Tree = BPlusTree<int, int, 8>;
+  Tree tree;
+  std::map<int, int> model;
+
+  for (int key = 0; key < 4000; key += 2) {
+    tree.insert(key, key);
+    model[key] = key;
+  }
+
+  Tree::Cursor cursor(tree);
+
+  // seeks walk forward while the tree changes between them, erases of
+  // missing keys included
+  for (int key = 0; key < 4000; key++) {
+    Tree::iterator it = cursor.seek(key);
+    auto expected = model.find(key);
+
+    CHECK((it == tree.end()) == (expected == model.end()));
+
+    if (it != tree.end() && expected != model.end()) {
+      CHECK(it.key() == key && *it == expected->second);
+    }
+
+    if (key % 3 == 0) {
+      CHECK(tree.erase(key + 1) == (model.erase(key + 1) == 1));
+    }
+
+    if (key % 5 == 0) {
+      tree.insert(key + 7, -key);
+      model[key + 7] = -key;
+    }
+  }
+
+  for (int key = 4000; key >= 0; key -= 3) {
+    Tree::iterator it = cursor.seek(key);
+    CHECK((it != tree.end()) == (model.count(key) == 1));
+  }
+
+  checkEntries(tree, model);
+}
+
+// ======= Batches =======
+
+static void testBatches() {
+  BPlusTree<int, int, 8> tree;
+  std::map<int, int> model;
+  std::mt19937 rng(28);
+
+  for (int round = 0; round < 50; round++) {
+    std::map<int, int> inserts;
+
+    for (int i = 0; i < 200; i++) {
+      inserts[rng() % 10000] = round;
+    }
+
+    std::vector<std::pair<int, int>> batch(inserts.begin(), inserts.end());
+    tree.insert_batch(batch.begin(), batch.end());
+
+    for (const auto &[key, value] : batch) {
+      model[key] = value;
+    }
+
+    std::set<int> erases;
+
+    for (int i = 0; i < 150; i++) {
+      erases.insert(rng() % 10000);
+    }
+
+    std::size_t erased = 0;
+
+    for (int key : erases) {
+      erased += model.erase(key);
+    }
+
+    CHECK(tree.erase_batch(erases.begin(), erases.end()) == erased);
+  }
+
+  checkEntries(tree, model);
+
+  std::vector<int> all;
+
+  for (const auto &entry : model) {
+    all.push_back(entry.first);
+  }
+
+  CHECK(tree.erase_batch(all.begin(), all.end()) == all.size());
+  checkEntries(tree, std::map<int, int>());
+}
+
+// ======= Clear =======
+
+static void testClearReusesPools() {
+  BPlusTree<int, std::string, 8, SegmentedFreelistAllocator<std::string>,
+            false, NoAggregate, CountingStats>
+      tree;
+  std::map<int, std::string> model;
+
+  for (int round = 0; round < 3; round++) {
+    tree.clear();
+    model.clear();
+
+    for (int key = 0; key < 5000; key++) {
+      int shuffled = key * 7919 % 5000;
+      tree.insert(shuffled, std::to_string(round));
+      model[shuffled] = std::to_string(round);
+    }
+
+    checkEntries(tree, model);
+  }
+
+  auto before = tree.statistics();
+  CHECK(before.leafPool.bytes > 0 && before.valuePool.bytes > 0);
+  tree.clear();
+  CHECK(tree.size() == 0 && tree.begin() == tree.end());
+
+  for (const auto &[key, value] : model) {
+    tree.insert(key, value);
+  }
+
+  // the refill is served from the segments kept by clear()
+  auto after = tree.statistics();
+  CHECK(after.innerPool.bytes == before.innerPool.bytes);
+  CHECK(after.leafPool.bytes == before.leafPool.bytes);
+  CHECK(after.valuePool.bytes == before.valuePool.bytes);
+  checkEntries(tree, model);
+}
+
+// ======= Order statistics =======
+
+static void testOrderStatistics() {
+  BPlusTree<int, int, 8, SegmentedFreelistAllocator<int>, true> tree;
+  std::set<int> model;
+  std::mt19937 rng(30);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 5000;
+
+    if (rng() % 3 == 0) {
+      CHECK(tree.erase(key) == (model.erase(key) == 1));
+    } else {
+      tree.insert(key, key);
+      model.insert(key);
+    }
+  }
+
+  tree.validate();
+  CHECK(tree.size() == model.size());
+
+  std::vector<int> keys(model.begin(), model.end());
+
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    CHECK(tree.rank(keys[i]) == i);
+    CHECK(tree.select(i).key() == keys[i]);
+  }
+
+  for (int i = 0; i < 1000; i++) {
+    int lo = rng() % 5200 - 100;
+    int hi = lo + rng() % 1000;
+    auto first = std::lower_bound(keys.begin(), keys.end(), lo);
+    auto last = std::lower_bound(keys.begin(), keys.end(), hi);
+
+    CHECK(tree.rank(lo) == std::size_t(first - keys.begin()));
+    CHECK(tree.count_range(lo, hi) == std::size_t(last - first));
+  }
+}
+
+// ======= Aggregates =======
+
+static void testAggregates() {
+  BPlusTree<int, long, 8, SegmentedFreelistAllocator<long>, false,
+            SumAggregate<long>>
+      sums;
+  BPlusTree<int, int, 8, SegmentedFreelistAllocator<int>, false,
+            MinAggregate<int>>
+      minima;
+  std::map<int, int> model;
+  std::mt19937 rng(31);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 4000;
+    int value = rng() % 1000 - 500;
+
+    if (rng() % 3 == 0) {
+      sums.erase(key);
+      minima.erase(key);
+      model.erase(key);
+    } else {
+      sums.insert(key, value);
+      minima.insert(key, value);
+      model[key] = value;
+    }
+  }
+
+  sums.validate();
+  minima.validate();
+
+  for (int i = 0; i < 500; i++) {
+    int lo = rng() % 4200 - 100;
+    int hi = lo + rng() % 2000;
+    long sum = 0;
+    int minimum = std::numeric_limits<int>::max();
+
+    for (auto it = model.lower_bound(lo); it != model.end() && it->first < hi;
+         ++it) {
+      sum += it->second;
+      minimum = std::min(minimum, it->second);
+    }
+
+    CHECK(sums.aggregate(lo, hi) == sum);
+    CHECK(minima.aggregate(lo, hi) == minimum);
+  }
+}
+
+// ======= Statistics =======
+
+static void testStatistics() {
+  BPlusTree<int, int, 8, SegmentedFreelistAllocator<int>, false, NoAggregate,
+            CountingStats>
+      tree;
+
+  for (int key = 0; key < 2000; key++) {
+    tree.insert(key * 7919 % 2000, key);
+  }
+
+  auto statistics = tree.statistics();
+  CHECK(statistics.counters.splits > 0);
+  CHECK(statistics.nodesPerLevel.size() > 1);
+  CHECK(statistics.nodesPerLevel.front() == 1);
+  CHECK(statistics.leafFill > 0.5 && statistics.leafFill <= 1);
+
+  tree.reset_statistics();
+
+  for (int key = 0; key < 100; key++) {
+    CHECK(tree.contains(key));
+  }
+
+  statistics = tree.statistics();
+  CHECK(statistics.counters.lookups == 100);
+  CHECK(statistics.counters.comparisons > 0);
+  CHECK(statistics.counters.splits == 0);
+  CHECK(statistics.comparisonsPerLookup > 0);
+}
+
+// ======= Diagnostics =======
+
+static void testDiagnostics() {
+  BPlusTree<int, int, 8> tree;
+  BTree<int, int, 5> btree;
+  std::set<int> model;
+  std::mt19937 rng(33);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 3000;
+
+    if (rng() % 3 == 0) {
+      tree.erase(key);
+      btree.erase(key);
+      model.erase(key);
+    } else {
+      tree.insert(key, key);
+      btree.insert(key, key);
+      model.insert(key);
+    }
+  }
+
+  tree.validate();
+  btree.validate();
+
+  auto report = tree.analyze();
+  CHECK(report.levels.size() > 1 && report.levels.front().nodes == 1);
+  CHECK(report.levels.back().keys == model.size());
+  CHECK(report.nodeBytes > report.unusedBytes);
+  CHECK(report.poolBytes >= report.nodeBytes + report.valueBytes);
+
+  auto breport = btree.analyze();
+  std::size_t entries = 0;
+
+  for (const auto &level : breport.levels) {
+    std::size_t bucketed = 0;
+
+    for (std::size_t nodes : level.fill) {
+      bucketed += nodes;
+    }
+
+    CHECK(bucketed == level.nodes);
+    entries += level.keys;
+  }
+
+  CHECK(entries == model.size());
+
+  for (int key : model) {
+    CHECK(btree.contains(key) && btree.at(key) == key);
+  }
+}
+
+// ======= Packed leaves =======
+
+static void testPackedLeaves() {
+  PackedBPlusTree<long, int, 8, 16> map;
+  PackedBPlusTree<int, NoValue, 8, 16> set;
+  std::map<long, int> model;
+  std::set<int> setModel;
+  std::mt19937 rng(34);
+
+  // dense runs keep one-byte lanes, the odd far key forces wider ones
+  for (int i = 0; i < 20000; i++) {
+    long key = rng() % 8 == 0 ? long(rng()) * 4099 - (1L << 40)
+                              : long(rng() % 3000) - 1000;
+
+    if (rng() % 3 == 0) {
+      CHECK(map.erase(key) == (model.erase(key) == 1));
+      CHECK(set.erase(int(key)) == (setModel.erase(int(key)) == 1));
+    } else {
+      map.insert(key, i);
+      model[key] = i;
+      set.insert(int(key));
+      setModel.insert(int(key));
+    }
+  }
+
+  CHECK(map.size() == model.size() && set.size() == setModel.size());
+  auto expected = model.begin();
+
+  for (auto it = map.begin(); it != map.end(); ++it, ++expected) {
+    if (expected == model.end()) {
+      CHECK(!"tree holds more entries than the model");
+      break;
+    }
+
+    CHECK(it.key() == expected->first && *it == expected->second);
+  }
+
+  std::vector<int> keys;
+
+  for (auto it = set.begin(); it != set.end(); ++it) {
+    keys.push_back(*it);
+  }
+
+  CHECK(keys == std::vector<int>(setModel.begin(), setModel.end()));
+
+  std::vector<std::pair<long, int>> visited;
+  map.for_each([&](long key, int value) { visited.emplace_back(key, value); });
+  std::vector<std::pair<long, int>> entries(model.begin(), model.end());
+  CHECK(visited == entries);
+
+  for (long key = -1100; key < 2100; key++) {
+    auto it = map.lower_bound(key);
+    auto bound = model.lower_bound(key);
+
+    CHECK((it == map.end()) == (bound == model.end()));
+    CHECK(it == map.end() || it.key() == bound->first);
+    CHECK(map.contains(key) == (model.count(key) == 1));
+    CHECK((map.find(key) != map.end()) == (model.count(key) == 1));
+
+    if (model.count(key) == 1) {
+      CHECK(map.at(key) == model[key]);
+    }
+  }
+
+  map.clear();
+  CHECK(map.empty() && map.begin() == map.end());
+}
+
+// ======= Multimap =======
+
+static void testMultimap() {
+  BPlusTreeMultimap<int, int, 8> multimap;
+  std::multimap<int, int> model;
+  std::mt19937 rng(35);
+
+  // few keys with many values each, so runs of one key span leaves
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 50;
+
+    if (rng() % 20 == 0) {
+      CHECK(multimap.erase(key) == model.erase(key));
+    } else {
+      multimap.insert(key, i);
+      model.emplace(key, i);
+    }
+  }
+
+  CHECK(multimap.size() == model.size());
+  const auto &view = multimap;
+  auto expected = model.begin();
+
+  // values of a key come out in insertion order, as with std::multimap
+  for (auto it = view.begin(); it != view.end(); ++it, ++expected) {
+    if (expected == model.end()) {
+      CHECK(!"multimap holds more entries than the model");
+      break;
+    }
+
+    CHECK(it.key().first == expected->first && *it == expected->second);
+  }
+
+  for (int key = -1; key <= 50; key++) {
+    auto [it, end] = multimap.equal_range(key);
+    auto [bound, last] = model.equal_range(key);
+
+    for (; it != end && bound != last; ++it, ++bound) {
+      CHECK(*it == bound->second);
+    }
+
+    CHECK(it == end && bound == last);
+    CHECK(multimap.count(key) == model.count(key));
+    CHECK(multimap.contains(key) == (model.count(key) > 0));
+  }
+
+  BPlusTree<int, int, 8> tree;
+  std::map<int, int> ranged;
+
+  for (int key = 0; key < 3000; key++) {
+    tree.insert(key, key);
+    ranged[key] = key;
+  }
+
+  CHECK(tree.erase_range(1000, 2500) == 1500);
+  CHECK(tree.erase_range(2900, 2900) == 0);
+  ranged.erase(ranged.lower_bound(1000), ranged.lower_bound(2500));
+  checkEntries(tree, ranged);
+}
+
+// ======= Sets =======
+
+static void testSets() {
+  BPlusTreeSet<int, 8, true> set;
+  std::set<int> model;
+  std::mt19937 rng(36);
+
+  for (int round = 0; round < 20; round++) {
+    std::set<int> batch;
+
+    for (int i = 0; i < 300; i++) {
+      batch.insert(rng() % 8000);
+    }
+
+    set.insert_batch(batch.begin(), batch.end());
+    model.insert(batch.begin(), batch.end());
+
+    for (int i = 0; i < 200; i++) {
+      int key = rng() % 8000;
+
+      if (i % 2 == 0) {
+        CHECK(set.erase(key) == (model.erase(key) == 1));
+      } else {
+        set.insert(key);
+        model.insert(key);
+      }
+    }
+  }
+
+  set.validate();
+  CHECK(set.size() == model.size());
+  std::vector<int> keys;
+
+  for (auto it = set.begin(); it != set.end(); ++it) {
+    CHECK(*it == it.key());
+    keys.push_back(*it);
+  }
+
+  CHECK(keys == std::vector<int>(model.begin(), model.end()));
+
+  for (int key = -10; key < 8010; key += 7) {
+    auto it = set.lower_bound(key);
+    auto bound = model.lower_bound(key);
+
+    CHECK((it == set.end()) == (bound == model.end()));
+    CHECK(it == set.end() || *it == *bound);
+    CHECK(set.contains(key) == (model.count(key) == 1));
+  }
+
+  for (std::size_t i = 0; i < keys.size(); i += 11) {
+    CHECK(set.rank(keys[i]) == i && *set.select(i) == keys[i]);
+  }
+
+  // the report counts only keys for set leaves
+  auto report = set.analyze();
+  CHECK(report.valueBytes == 0);
+}
+
+// ======= Relaxed deletion =======
+
+// leaves of a tree with fanout 10 holding fewer than 5 keys, read off the
+// fill buckets of the report, one per key count
+template <typename Tree> static std::size_t underfullLeaves(const Tree &tree) {
+  auto report = tree.analyze();
+  std::size_t leaves = 0;
+
+  for (std::size_t keys = 0; keys < 5; keys++) {
+    leaves += report.levels.back().fill[keys];
+  }
+
+  return leaves;
+}
+
+static void testRelaxedDeletion() {
+  BPlusTree<int, int, 10> tree;
+  std::map<int, int> model;
+  std::mt19937 rng(37);
+
+  tree.set_leaf_minimum(0);
+  CHECK(tree.leaf_minimum() == 1);
+  tree.set_leaf_minimum(2);
+  CHECK(tree.leaf_minimum() == 2);
+
+  for (int key = 0; key < 10000; key++) {
+    tree.insert(key, key);
+    model[key] = key;
+  }
+
+  std::vector<int> batch;
+
+  for (int key = 0; key < 10000; key++) {
+    if (rng() % 10 < 6) {
+      if (key % 2 == 0) {
+        CHECK(tree.erase(key));
+      } else {
+        batch.push_back(key);
+      }
+
+      model.erase(key);
+    }
+  }
+
+  CHECK(tree.erase_batch(batch.begin(), batch.end()) == batch.size());
+
+  // erases left leaves below half fill, which the invariants allow
+  checkEntries(tree, model);
+  CHECK(underfullLeaves(tree) > 0);
+
+  tree.compact();
+  checkEntries(tree, model);
+  CHECK(underfullLeaves(tree) == 0);
+}
+
+// ======= Buffered =======
+
+static void testBuffered() {
+  BufferedBPlusTree<int, int, 8, 64> tree;
+  std::map<int, int> model;
+  std::mt19937 rng(38);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 3000;
+
+    if (rng() % 3 == 0) {
+      tree.erase(key);
+      model.erase(key);
+    } else {
+      tree.insert(key, i);
+      model[key] = i;
+    }
+
+    CHECK(tree.pending() < 64);
+
+    // lookups see pending messages, the newest one per key winning
+    int probe = rng() % 3000;
+    auto expected = model.find(probe);
+    CHECK(tree.contains(probe) == (expected != model.end()));
+
+    if (expected != model.end()) {
+      CHECK(tree.at(probe) == expected->second);
+    }
+  }
+
+  CHECK(tree.size() == model.size() && tree.pending() == 0);
+  checkEntries(tree.flushed(), model);
+
+  tree.erase(model.begin()->first);
+  tree.clear();
+  CHECK(tree.pending() == 0 && tree.empty());
+}
+
+// ======= Split and join =======
+
+template <bool Ranked> static void testSplitJoin() {
+  using Tree = BPlusTree<int, int, 8, SegmentedFreelistAllocator<int>, Ranked>;
+  Tree tree;
+  std::map<int, int> model;
+  std::mt19937 rng(42);
+
+  CHECK(tree.empty());
+
+  for (int i = 0; i < 3000; i++) {
+    int key = rng() % 5000;
+    tree.insert(key, i);
+    model[key] = i;
+  }
+
+  CHECK(!tree.empty());
+
+  for (int round = 0; round < 100; round++) {
+    int cut = int(rng() % 5400) - 200;
+    std::map<int, int> lower(model.begin(), model.lower_bound(cut));
+    std::map<int, int> upper(model.lower_bound(cut), model.end());
+    Tree right;
+
+    tree.split_at(cut, right);
+    checkEntries(tree, lower);
+    checkEntries(right, upper);
+    CHECK(tree.empty() == lower.empty() && right.empty() == upper.empty());
+
+    tree.join(right);
+    CHECK(right.empty());
+    checkEntries(tree, model);
+  }
+
+  // a tree built apart has its nodes copied into this tree's pools
+  Tree higher;
+
+  for (int key = 6000; key < 7000; key++) {
+    higher.insert(key, key);
+    model[key] = key;
+  }
+
+  tree.join(higher);
+  checkEntries(tree, model);
+  CHECK(higher.empty());
+
+  // a tree entirely below this one is joined in front
+  Tree lower;
+
+  for (int key = -1000; key < 0; key++) {
+    lower.insert(key, key);
+    model[key] = key;
+  }
+
+  tree.join(lower);
+  checkEntries(tree, model);
+  CHECK(lower.empty());
+
+  Tree front;
+  tree.split_at(-500, front);
+  std::swap(tree, front);
+  tree.join(front);
+  checkEntries(tree, model);
+
+  Tree overlapping;
+  overlapping.insert(0, 0);
+  bool thrown = false;
+
+  try {
+    tree.join(overlapping);
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+
+  CHECK(thrown && overlapping.size() == 1);
+
+  Tree empty;
+  empty.join(tree);
+  checkEntries(empty, model);
+  CHECK(tree.empty() && tree.size() == 0);
+}
+
+// ======= Sharded =======
+
+template <bool Ranked> static void testSharded() {
+  constexpr std::size_t Shards = 4;
+  ShardedBPlusTree<int, int, 8, Shards, SegmentedFreelistAllocator<int>,
+                   Ranked>
+      sharded;
+  std::map<int, int> model;
+  std::mt19937 rng(39);
+
+  // ascending keys pile up in the last shard and keep forcing rebalances
+  for (int key = 0; key < 5000; key++) {
+    sharded.insert(key, key);
+    model[key] = key;
+  }
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 12000 - 2000;
+
+    if (rng() % 3 == 0) {
+      CHECK(sharded.erase(key) == (model.erase(key) == 1));
+    } else {
+      sharded.insert(key, i);
+      model[key] = i;
+    }
+  }
+
+  CHECK(sharded.size() == model.size());
+  auto expected = model.begin();
+
+  for (auto it = sharded.begin(); it != sharded.end(); ++it, ++expected) {
+    if (expected == model.end()) {
+      CHECK(!"sharded tree holds more entries than the model");
+      break;
+    }
+
+    CHECK(it.key() == expected->first && *it == expected->second);
+  }
+
+  sharded.rebalance();
+
+  // each shard takes its share and all its keys route back to it
+  for (std::size_t i = 0; i < Shards; i++) {
+    auto &shard = sharded.shard(i);
+    std::size_t share = ((i + 1) * model.size() / Shards) -
+                        (i * model.size() / Shards);
+
+    shard.validate();
+    CHECK(shard.size() == share);
+
+    for (auto it = shard.begin(); it != shard.end(); ++it) {
+      CHECK(sharded.shard_of(it.key()) == i);
+    }
+  }
+
+  for (int key = -2100; key < 10100; key += 3) {
+    auto found = sharded.find(key);
+    auto entry = model.find(key);
+
+    CHECK((found == sharded.end()) == (entry == model.end()));
+    CHECK(sharded.contains(key) == (entry != model.end()));
+
+    if (entry != model.end()) {
+      CHECK(sharded.at(key) == entry->second && found.key() == key);
+    }
+  }
+
+  // fewer keys than shards leave empty shards the bounds skip over
+  sharded.clear();
+  sharded.insert(5, 5);
+  sharded.insert(7, 7);
+  sharded.rebalance();
+  CHECK(sharded.size() == 2 && sharded.at(5) == 5 && sharded.at(7) == 7);
+  CHECK(!sharded.contains(6) && sharded.begin().key() == 5);
+}
+
+// ======= Parallel bulk load and scan =======
+
+static void testParallelBulkLoad() {
+  BPlusTree<int, long, 8, SegmentedFreelistAllocator<long>, true,
+            SumAggregate<long>>
+      tree;
+
+  for (std::size_t count : {0, 1, 8, 9, 77, 20000}) {
+    for (unsigned threads : {1u, 4u}) {
+      std::vector<std::pair<int, long>> entries;
+      std::map<int, long> model;
+
+      for (std::size_t i = 0; i < count; i++) {
+        entries.emplace_back(int(3 * i), long(i));
+        model[int(3 * i)] = long(i);
+      }
+
+      tree.insert(-1, -1); // replaced by the load
+      tree.bulk_load(entries.begin(), entries.end(), threads);
+      checkEntries(tree, model);
+
+      long sum = long(count) * (long(count) - 1) / 2;
+      CHECK(tree.aggregate(0, 3 * int(count)) == sum);
+      CHECK(count == 0 || tree.select(count / 2).key() == 3 * int(count / 2));
+
+      // every entry is visited exactly once and may be updated in place
+      std::atomic<long> visited = 0;
+      std::atomic<long> mismatched = 0;
+      tree.parallel_for_each(
+          [&](const int &key, long &value) {
+            mismatched += value != key / 3;
+            value = -value;
+            visited++;
+          },
+          threads);
+
+      CHECK(visited == long(count) && mismatched == 0);
+
+      for (auto &[key, value] : model) {
+        value = -value;
+      }
+
+      std::vector<std::pair<int, long>> seen;
+
+      for (auto it = tree.begin(); it != tree.end(); ++it) {
+        seen.emplace_back(it.key(), *it);
+      }
+
+      std::vector<std::pair<int, long>> expected(model.begin(), model.end());
+      CHECK(seen == expected);
+    }
+  }
+
+  // the loaded tree takes further inserts and erases as usual
+  std::map<int, long> model;
+  std::vector<std::pair<int, long>> entries;
+
+  for (int key = 0; key < 5000; key++) {
+    entries.emplace_back(2 * key, key);
+    model[2 * key] = key;
+  }
+
+  tree.bulk_load(entries.begin(), entries.end(), 3);
+
+  for (int key = 1; key < 10000; key += 4) {
+    tree.insert(key, key);
+    model[key] = key;
+    CHECK(tree.erase(key + 1) == (model.erase(key + 1) == 1));
+  }
+
+  checkEntries(tree, model);
+}
+
+// ======= Set operations =======
+
+static void testSetOperations() {
+  using Tree = BPlusTree<int, int, 8>;
+  using Entries = std::vector<std::pair<int, int>>;
+  std::mt19937 rng(41);
+
+  auto byKey = [](const auto &x, const auto &y) { return x.first < y.first; };
+
+  auto entriesOf = [](Tree &tree) {
+    Entries entries;
+
+    for (auto it = tree.begin(); it != tree.end(); ++it) {
+      entries.emplace_back(it.key(), *it);
+    }
+
+    return entries;
+  };
+
+  // sizes cover empty inputs, a single leaf and trees several levels deep
+  for (int sizeA : {0, 5, 3000}) {
+    for (int sizeB : {0, 7, 2000}) {
+      for (unsigned threads : {1u, 4u}) {
+        Tree a, b, result;
+        std::map<int, int> modelA, modelB;
+
+        for (int i = 0; i < sizeA; i++) {
+          int key = rng() % (2 * sizeA);
+          a.insert(key, 1);
+          modelA[key] = 1;
+        }
+
+        for (int i = 0; i < sizeB; i++) {
+          int key = rng() % (2 * sizeA + 10);
+          b.insert(key, 2);
+          modelB[key] = 2;
+        }
+
+        result.insert(-1, -1); // replaced by each operation
+        Entries expected;
+
+        result.merge(a, b, threads);
+        std::set_union(modelA.begin(), modelA.end(), modelB.begin(),
+                       modelB.end(), std::back_inserter(expected), byKey);
+        result.validate();
+        CHECK(entriesOf(result) == expected);
+        CHECK(result.size() == expected.size());
+
+        expected.clear();
+        result.intersect(a, b, threads);
+        std::set_intersection(modelA.begin(), modelA.end(), modelB.begin(),
+                              modelB.end(), std::back_inserter(expected),
+                              byKey);
+        result.validate();
+        CHECK(entriesOf(result) == expected);
+        CHECK(result.size() == expected.size());
+
+        expected.clear();
+        result.difference(a, b, threads);
+        std::set_difference(modelA.begin(), modelA.end(), modelB.begin(),
+                            modelB.end(), std::back_inserter(expected), byKey);
+        result.validate();
+        CHECK(entriesOf(result) == expected);
+        CHECK(result.size() == expected.size());
+
+        // the inputs are left as they were
+        checkEntries(a, modelA);
+        checkEntries(b, modelB);
+      }
+    }
+  }
+
+  BPlusTreeSet<int, 8> x, y, z;
+  std::set<int> modelX, modelY;
+
+  for (int i = 0; i < 2000; i++) {
+    x.insert(3 * i);
+    modelX.insert(3 * i);
+    y.insert(5 * i);
+    modelY.insert(5 * i);
+  }
+
+  auto keysOf = [](BPlusTreeSet<int, 8> &set) {
+    std::vector<int> keys;
+
+    for (auto it = set.begin(); it != set.end(); ++it) {
+      keys.push_back(*it);
+    }
+
+    return keys;
+  };
+
+  std::vector<int> expected;
+  z.merge(x, y);
+  std::set_union(modelX.begin(), modelX.end(), modelY.begin(), modelY.end(),
+                 std::back_inserter(expected));
+  z.validate();
+  CHECK(keysOf(z) == expected);
+
+  expected.clear();
+  z.intersect(x, y);
+  std::set_intersection(modelX.begin(), modelX.end(), modelY.begin(),
+                        modelY.end(), std::back_inserter(expected));
+  z.validate();
+  CHECK(keysOf(z) == expected);
+
+  expected.clear();
+  z.difference(x, y);
+  std::set_difference(modelX.begin(), modelX.end(), modelY.begin(),
+                      modelY.end(), std::back_inserter(expected));
+  z.validate();
+  CHECK(keysOf(z) == expected);
+}
+
+// ======= Fanout tuning =======
+
+// checks that nodes of a tree tuned for TargetBytes fit it, measuring them
+// through the report of a tree with one leaf and of one with a single inner
+// node above its leaves
+template <typename Key, typename Value, std::size_t TargetBytes>
+static void checkTunedFanout() {
+  constexpr std::size_t fanout = bplustreeFanout<Key, Value, TargetBytes>();
+  static_assert(bplustreeNodeBytes<Key, Value>(fanout) <= TargetBytes);
+  static_assert(bplustreeNodeBytes<Key, Value>(fanout + 1) > TargetBytes);
+
+  BPlusTreeFor<Key, Value, TargetBytes> tree;
+  std::map<Key, Value> model;
+
+  tree.insert(Key(0), Value(0));
+  std::size_t leafBytes = tree.analyze().nodeBytes;
+  CHECK(leafBytes <= TargetBytes);
+  CHECK((leafBytes <= bplustreeNodeBytes<Key, Value>(fanout)));
+
+  for (std::size_t i = 1; i <= fanout; i++) {
+    tree.insert(Key(i), Value(i));
+  }
+
+  auto report = tree.analyze();
+  CHECK(report.levels.size() == 2);
+  CHECK(report.nodeBytes - report.levels.back().nodes * leafBytes <=
+        TargetBytes);
+
+  for (int i = 0; i < 5000; i++) {
+    Key key = Key(i * 7919 % 3000);
+
+    if (i % 3 == 0) {
+      tree.erase(key);
+      model.erase(key);
+    } else {
+      tree.insert(key, Value(i));
+      model[key] = Value(i);
+    }
+  }
+
+  checkEntries(tree, model);
+}
+
+static void testFanoutTuning() {
+  checkTunedFanout<int, int, 256>();
+  checkTunedFanout<std::uint64_t, double, 512>();
+  checkTunedFanout<std::int16_t, char, 4096>();
+  checkTunedFanout<double, long, 1024>();
+}
+
+// ======= Prefetching =======
+
+static void testPrefetchDistance() {
+  BPlusTree<int, int, 8> tree;
+  std::map<int, int> model;
+
+  CHECK(tree.prefetch_distance() == 2);
+
+  for (int key = 0; key < 3000; key += 3) {
+    tree.insert(key, -key);
+    model[key] = -key;
+  }
+
+  // distances up to past the last leaf, where prefetching has to stop
+  for (unsigned distance : {0u, 1u, 2u, 7u, 1000u}) {
+    tree.set_prefetch_distance(distance);
+    CHECK(tree.prefetch_distance() == distance);
+
+    auto it = tree.begin();
+    tree.set_prefetch_distance(3); // iterators keep their own distance
+    checkEntries(tree, model);
+    tree.set_prefetch_distance(distance);
+
+    std::vector<int> forward, backward;
+
+    for (; it != tree.end(); ++it) {
+      forward.push_back(it.key());
+    }
+
+    for (auto rit = tree.rbegin(); rit != tree.rend(); ++rit) {
+      backward.push_back(rit.key());
+    }
+
+    std::reverse(backward.begin(), backward.end());
+    CHECK(forward == backward && forward.size() == model.size());
+
+    const auto &view = tree;
+    std::size_t scanned = 0;
+
+    for (auto cit = view.lower_bound(1500); cit != view.end(); ++cit) {
+      scanned++;
+    }
+
+    CHECK(scanned == model.size() - model.lower_bound(1500)->first / 3);
+
+    std::atomic<std::size_t> visited = 0;
+    tree.parallel_for_each([&](const int &, int &) { visited++; }, 2);
+    CHECK(visited == model.size());
+  }
+}
+
+// ======= In-place updates =======
+
+static void testInPlaceUpdates() {
+  BPlusTree<int, std::string, 8, SegmentedFreelistAllocator<std::string>,
+            false, NoAggregate, CountingStats>
+      tree;
+  std::map<int, std::string> model;
+  std::mt19937 rng(45);
+
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 2000;
+    std::string value = std::to_string(i);
+
+    switch (rng() % 4) {
+    case 0: {
+      // a present key leaves the argument unmoved
+      bool inserted = model.try_emplace(key, value).second;
+      CHECK(tree.try_emplace(key, std::move(value)) == inserted);
+
+      if (!inserted) {
+        CHECK(value == std::to_string(i));
+      }
+
+      break;
+    }
+    case 1:
+      CHECK(tree.insert_or_assign(key, value) ==
+            model.insert_or_assign(key, value).second);
+      break;
+    case 2:
+      CHECK(tree.upsert(key, [](std::string &count) { count += "+"; }) ==
+            (model.count(key) == 0));
+      model[key] += "+";
+      break;
+    default:
+      CHECK(tree.erase(key) == (model.erase(key) == 1));
+    }
+  }
+
+  checkEntries(tree, model);
+
+  // replacing existing values reuses their slots, nothing is allocated
+  const std::string *before = &tree.at(model.begin()->first);
+  auto pools = tree.statistics();
+
+  for (auto &[key, value] : model) {
+    CHECK(!tree.insert_or_assign(key, std::string("x")));
+    CHECK(!tree.upsert(key, [](std::string &current) { current += "y"; }));
+    value = "xy";
+  }
+
+  CHECK(&tree.at(model.begin()->first) == before);
+  CHECK(tree.statistics().valuePool.bytes == pools.valuePool.bytes);
+  checkEntries(tree, model);
+}
+
+// ======= Node handles =======
+
+static void testNodeHandles() {
+  using Tree = BPlusTree<int, std::string, 8,
+                         SegmentedFreelistAllocator<std::string>>;
+  Tree source, target;
+  std::map<int, std::string> sourceModel, targetModel;
+
+  for (int key = 0; key < 2000; key++) {
+    source.insert(key, std::to_string(key));
+    sourceModel[key] = std::to_string(key);
+  }
+
+  CHECK(source.extract(5000).empty());
+
+  // a handle put back into its own tree keeps the value where it was
+  const std::string *slot = &source.at(700);
+  Tree::node_type handle = source.extract(700);
+  CHECK(handle && handle.key() == 700 && handle.mapped() == "700");
+  CHECK(!source.contains(700));
+  handle.key() = 2700;
+  handle.mapped() += "!";
+  CHECK(source.insert(std::move(handle)) && handle.empty());
+  CHECK(&source.at(2700) == slot && source.at(2700) == "700!");
+  sourceModel.erase(700);
+  sourceModel[2700] = "700!";
+
+  // other pools get the value moved over, a taken key keeps the handle full
+  for (int key = 0; key < 2000; key += 3) {
+    Tree::node_type moved = source.extract(key);
+
+    if (key % 2 == 0) {
+      target.insert(key, "taken");
+      targetModel[key] = "taken";
+      CHECK(!target.insert(std::move(moved)));
+      CHECK(moved.mapped() == sourceModel[key]);
+    } else {
+      CHECK(target.insert(std::move(moved)));
+      targetModel[key] = sourceModel[key];
+    }
+
+    sourceModel.erase(key);
+  }
+
+  checkEntries(source, sourceModel);
+  checkEntries(target, targetModel);
+
+  // extracting the last key keeps the value alive until the handle goes
+  Tree single;
+  single.insert(1, std::string(100, 'v'));
+  Tree::node_type last = single.extract(1);
+  CHECK(single.size() == 0 && last.mapped() == std::string(100, 'v'));
+  single.insert(2, "refill");
+  CHECK(last.mapped() == std::string(100, 'v'));
+  CHECK(single.insert(std::move(last)) && single.size() == 2);
+  CHECK(single.at(1) == std::string(100, 'v'));
+
+  BPlusTreeSet<int, 8> set, otherSet;
+
+  for (int key = 0; key < 100; key++) {
+    set.insert(key);
+  }
+
+  for (int key = 0; key < 100; key += 2) {
+    CHECK(otherSet.insert(set.extract(key)));
+  }
+
+  set.validate();
+  otherSet.validate();
+  CHECK(set.size() == 50 && otherSet.size() == 50);
+  CHECK(otherSet.contains(98) && !set.contains(98) && set.contains(99));
+}
+
+// ======= Memory resources and arenas =======
+
+// memory resource that counts the bytes handed out and not yet returned
+class CountingResource : public std::pmr::memory_resource {
+public:
+  std::size_t outstanding = 0;
+
+private:
+  void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+    outstanding += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, std::size_t bytes,
+                     std::size_t alignment) override {
+    outstanding -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// value that counts its live instances
+struct Tracked {
+  static inline long live = 0;
+  int value;
+
+  Tracked(int value) : value(value) { live++; }
+  Tracked(const Tracked &other) : value(other.value) { live++; }
+  ~Tracked() { live--; }
+
+  Tracked &operator=(const Tracked &) = default;
+};
+
+template <typename Arena>
+concept Releasable = requires(Arena &arena) { arena.release(); };
+
+static void testMemoryResources() {
+  using Numbers = BPlusTree<int, long, 8>;
+  using Objects = BPlusTree<int, Tracked, 8>;
+
+  // releasing would skip destructors that free memory
+  static_assert(Releasable<Numbers::Arena>);
+  static_assert(!Releasable<Objects::Arena>);
+  static_assert(!Releasable<BPlusTree<int, std::string, 8>::Arena>);
+
+  CountingResource resource;
+
+  {
+    Numbers tree(&resource);
+
+    for (int key = 0; key < 5000; key++) {
+      tree.insert(key, key);
+    }
+
+    CHECK(resource.outstanding > 0);
+    tree.validate();
+  }
+
+  CHECK(resource.outstanding == 0);
+
+  {
+    Numbers::Arena arena(&resource);
+    std::vector<Numbers> trees;
+    std::vector<std::map<int, long>> models(20);
+
+    for (int i = 0; i < 20; i++) {
+      trees.emplace_back(arena);
+    }
+
+    for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < 20000; i++) {
+        int tree = i % 20;
+        trees[tree].insert(i, i + round);
+        models[tree][i] = i + round;
+      }
+
+      for (int i = 0; i < 20; i++) {
+        checkEntries(trees[i], models[i]);
+      }
+
+      // the trees draw from the arena, which frees everything at once
+      CHECK(resource.outstanding > 0);
+      arena.release();
+      CHECK(resource.outstanding == 0);
+
+      for (int i = 0; i < 20; i++) {
+        trees[i].clear();
+        models[i].clear();
+        CHECK(trees[i].empty());
+      }
+    }
+  }
+
+  CHECK(resource.outstanding == 0);
+
+  // trees on an arena whose values own resources destroy them one by one
+  {
+    Objects::Arena arena(&resource);
+    Objects first(arena), second(arena);
+
+    for (int key = 0; key < 3000; key++) {
+      (key % 2 ? first : second).insert(key, Tracked(key));
+    }
+
+    CHECK(Tracked::live == 3000);
+    first.clear();
+    CHECK(Tracked::live == 1500);
+  }
+
+  CHECK(Tracked::live == 0 && resource.outstanding == 0);
+}
+
+// ======= Small trees =======
+
+static void testSmallTrees() {
+  using Small = SmallBPlusTree<int, std::string, 4>;
+  std::string one(40, '1'), three(40, '3'); // too long to be stored inline
+
+  // values passed by reference to an inline entry survive the entries being
+  // shifted, or moved into the tree by the insert that spills them
+  Small shifted;
+  shifted.insert(1, one);
+  shifted.insert(3, three);
+  shifted.emplace(0, shifted.at(3));
+  CHECK(shifted.at(0) == three && shifted.at(3) == three);
+  shifted.emplace(4, shifted.at(1));
+  CHECK(shifted.size() == 4 && shifted.at(4) == one);
+
+  shifted.emplace(10, shifted.at(1));
+  CHECK(shifted.size() == 5 && shifted.at(10) == one && shifted.at(1) == one);
+
+  Small spilled;
+
+  for (int key = 0; key < 4; key++) {
+    spilled.insert(key, key == 1 ? one : three);
+  }
+
+  CHECK(spilled.try_emplace(-1, spilled.at(1)));
+  CHECK(spilled.at(-1) == one && spilled.at(1) == one);
+
+  Small small;
+  std::map<int, std::string> model;
+  std::mt19937 rng(48);
+
+  // keys from a narrow range so the tree keeps spilling and shrinking back
+  for (int i = 0; i < 20000; i++) {
+    int key = rng() % 9;
+
+    if (rng() % 2 == 0) {
+      CHECK(small.erase(key) == (model.erase(key) == 1));
+    } else {
+      small.insert(key, std::to_string(i));
+      model[key] = std::to_string(i);
+    }
+
+    CHECK(small.size() == model.size());
+
+    if (i % 50 == 0) {
+      std::map<int, std::string> seen;
+
+      for (auto it = small.begin(); it != small.end(); ++it) {
+        seen[it.key()] = *it;
+      }
+
+      CHECK(seen == model);
+    }
+  }
+
+  SmallBPlusTree<int, NoValue, 4> set;
+
+  for (int key = 10; key > 0; key--) {
+    set.insert(key);
+  }
+
+  CHECK(set.size() == 10 && set.contains(1) && !set.contains(11));
+}
+
+// ======= Leaf directory =======
+
+template <typename Key> static void checkDirectory(Key lowest) {
+  using Tree = BPlusTree<Key, int, 8>;
+  Tree tree;
+  std::map<Key, int> model;
+  std::mt19937 rng(49);
+
+  tree.set_directory(true);
+  CHECK(tree.has_directory());
+
+  // appends keep the directory in step, the rest leave it stale for a while
+  for (int i = 0; i < 3000; i++) {
+    Key key = Key(lowest + Key(3 * i));
+    tree.insert(key, i);
+    model[key] = i;
+  }
+
+  const Tree &view = tree;
+
+  for (int i = 0; i < 30000; i++) {
+    Key key = Key(lowest + Key(rng() % 12000));
+
+    switch (rng() % 4) {
+    case 0:
+      tree.insert(key, i);
+      model[key] = i;
+      break;
+    case 1:
+      CHECK(tree.erase(key) == (model.erase(key) == 1));
+      break;
+    case 2: {
+      auto it = tree.find(key);
+      auto expected = model.find(key);
+      CHECK((it == tree.end()) == (expected == model.end()));
+      CHECK(it == tree.end() || *it == expected->second);
+      break;
+    }
+    default:
+      CHECK(view.contains(key) == (model.count(key) == 1));
+    }
+
+    if (i % 5000 == 0) {
+      std::vector<Key> batch;
+
+      for (int j = 0; j < 100; j++) {
+        batch.push_back(Key(lowest + Key(rng() % 12000)));
+      }
+
+      std::sort(batch.begin(), batch.end());
+      batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+
+      std::size_t erased = 0;
+
+      for (Key erasedKey : batch) {
+        erased += model.erase(erasedKey);
+      }
+
+      CHECK(tree.erase_batch(batch.begin(), batch.end()) == erased);
+      checkEntries(tree, model);
+    }
+  }
+
+  checkEntries(tree, model);
+
+  // the moved-to tree keeps the directory and rebuilds it on lookups
+  Tree moved(std::move(tree));
+  CHECK(moved.has_directory());
+
+  for (const auto &[key, value] : model) {
+    CHECK(moved.at(key) == value);
+  }
+
+  checkEntries(moved, model);
+
+  moved.set_directory(false);
+  CHECK(!moved.has_directory());
+  checkEntries(moved, model);
+}
+
+static void testLeafDirectory() {
+  checkDirectory<int>(-5000);
+  checkDirectory<std::uint32_t>(7);
+  checkDirectory<std::int64_t>(std::int64_t(1) << 40);
+}
+
+// ======= Interpolation =======
+
+// runs the same updates on a tree that interpolates within its wide nodes and
+// on a model, with keys drawn by next
+template <typename Key, typename Next>
+static void checkInterpolation(Next next) {
+  BPlusTree<Key, int, 128> tree;
+  std::map<Key, int> model;
+  std::mt19937 rng(50);
+
+  CHECK(!tree.interpolation());
+  tree.set_interpolation(true);
+  CHECK(tree.interpolation());
+
+  for (int i = 0; i < 30000; i++) {
+    Key key = next(rng);
+
+    if (rng() % 4 == 0) {
+      CHECK(tree.erase(key) == (model.erase(key) == 1));
+    } else {
+      tree.insert(key, i);
+      model[key] = i;
+    }
+  }
+
+  checkEntries(tree, model);
+
+  for (int i = 0; i < 5000; i++) {
+    Key key = next(rng);
+    auto it = tree.lower_bound(key);
+    auto bound = model.lower_bound(key);
+
+    CHECK((it == tree.end()) == (bound == model.end()));
+    CHECK(it == tree.end() || it.key() == bound->first);
+    CHECK(tree.contains(key) == (model.count(key) == 1));
+  }
+
+  for (const auto &[key, value] : model) {
+    CHECK(tree.at(key) == value);
+  }
+}
+
+static void testInterpolation() {
+  // evenly spread keys, where the first guess is close
+  checkInterpolation<int>([](std::mt19937 &rng) { return int(rng() % 50000); });
+
+  // clusters far apart, so the line through a node misses badly
+  checkInterpolation<std::uint64_t>([](std::mt19937 &rng) {
+    std::uint64_t cluster = rng() % 4;
+    return (cluster << (16 * cluster)) + rng() % 3000;
+  });
+
+  // floating point keys spread exponentially, negative ones included
+  checkInterpolation<double>([](std::mt19937 &rng) {
+    double key = std::ldexp(double(rng() % 1000), int(rng() % 40) - 20);
+    return rng() % 2 ? key : -key;
+  });
+}
+
+int main() {
+  run("sequential insert", testSequentialInsert);
+  run("cursor", testCursor);
+  run("batches", testBatches);
+  run("clear reuses pools", testClearReusesPools);
+  run("order statistics", testOrderStatistics);
+  run("aggregates", testAggregates);
+  run("statistics", testStatistics);
+  run("diagnostics", testDiagnostics);
+  run("packed leaves", testPackedLeaves);
+  run("multimap", testMultimap);
+  run("sets", testSets);
+  run("relaxed deletion", testRelaxedDeletion);
+  run("buffered", testBuffered);
+  run("split and join", testSplitJoin<false>);
+  run("ranked split and join", testSplitJoin<true>);
+  run("sharded", testSharded<false>);
+  run("ranked sharded", testSharded<true>);
+  run("parallel bulk load", testParallelBulkLoad);
+  run("set operations", testSetOperations);
+  run("fanout tuning", testFanoutTuning);
+  run("prefetch distance", testPrefetchDistance);
+  run("in-place updates", testInPlaceUpdates);
+  run("node handles", testNodeHandles);
+  run("memory resources", testMemoryResources);
+  run("small trees", testSmallTrees);
+  run("leaf directory", testLeafDirectory);
+  run("interpolation", testInterpolation);
+
+  if (failures > 0) {
+    std::printf("%d checks failed\n", failures);
+    return 1;
+  }
+
+  std::printf("all tests passed\n");
+  return 0;
+}